@@ -0,0 +1,54 @@
+/* 
+ * mymetrics.c - Query a tsh metrics socket (tsh -m) for the tests
+ * 
+ * usage: mymetrics <socket>
+ * Prints the snapshot with the fields that change from run to run
+ * left out: each job line keeps its jid, state and command line, and
+ * each histogram line just the number of samples in it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char **argv) 
+{
+    struct sockaddr_un addr;
+    char line[2048], state[16], *p;
+    unsigned long b, n, total;
+    int fd, jid, len;
+    FILE *fp;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <socket>\n", argv[0]);
+	exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	perror(argv[1]);
+	exit(1);
+    }
+    fp = fdopen(fd, "r");
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (sscanf(line, "job %d %*d %15s %*s %*s %n", &jid, state, &len) == 2) {
+	    printf("job %d %s %s", jid, state, line + len);
+	} else if (strstr(line, "_us") != NULL) {
+	    p = strchr(line, ' ');
+	    total = 0;
+	    while (p != NULL && sscanf(p, " %lu:%lu", &b, &n) == 2) {
+		total += n;
+		p = strchr(p + 1, ' ');
+	    }
+	    printf("%.*s %lu\n", (int)strcspn(line, " \n"), line, total);
+	} else {
+	    printf("%s", line);
+	}
+    }
+    exit(0);
+}
@@ -4,6 +4,7 @@
  * Zach Lockett-Streiff (zlocket1)
  * Taylor Nation (tnation1)
  */
+#define _GNU_SOURCE         /* for pipe2 and ppoll */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,13 +13,32 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/memfd.h>
+#include <stdint.h>
+#include <sys/file.h>
 #include "tsh.h"
 
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+volatile sig_atomic_t fgstatus; /* wait status of the last FG job to end or stop */
+volatile sig_atomic_t interrupted; /* ctrl-c was typed with no FG job */
+int laststatus;             /* exit status of the last command ($?) */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
@@ -26,9 +46,197 @@ struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
+    long long start;        /* CLOCK_MONOTONIC ns when the job was added */
     char cmdline[MAXLINE];  /* command line */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+struct jobsel_t {           /* A job picked by jobselect */
+    int slot;               /* its index in jobs */
+    pid_t pid;              /* its PID, to tell if the slot was reused */
+};
+int jidslot[MAXJOBS + 1];   /* slot + 1 of the job with each JID, or 0 */
+int jobnames[MAXJOBS];      /* slots of the jobs, sorted by command line */
+int njobnames;              /* number of jobs in jobnames */
+int curjid, prevjid;        /* the current (%+) and previous (%-) jobs */
+int pidslot[PIDHASH];       /* slot + 1 of each job, hashed by PID */
+uint64_t slotused[MAXJOBS / 64]; /* a bit set for each slot in use */
+int fgslot;                 /* slot + 1 of the FG job, or 0 */
+int topjid;                 /* largest JID in use, or 0 */
+unsigned jobseq;            /* seqlock: odd while jobs is being changed */
+int jobsdepth;              /* nesting of jobsbegin (handlers nest) */
+
+struct metrics_t {          /* Counters, shared with our children */
+    unsigned long started;  /* jobs added */
+    unsigned long reaped;   /* jobs that exited or were killed */
+    unsigned long signalled; /* signals we sent to jobs */
+    unsigned long forkexec[HISTBUCKETS]; /* fork to execve, log2 us */
+    unsigned long exitreap[HISTBUCKETS]; /* SIGCHLD to reaped, log2 us */
+};
+struct metrics_t *metrics;  /* NULL unless -m was given */
+int metricsfd = -1;         /* listening socket */
+char *metricssock;          /* its path, removed when we exit */
+pid_t metricspid;           /* the shell that bound it */
+struct job_t metricjobs[MAXJOBS]; /* the server thread's snapshot */
+
+struct tracering_t {        /* The event ring, shared with our children */
+    unsigned long head;     /* number of events ever recorded */
+    unsigned long tail;     /* head when the ring was last cleared */
+    struct trace_event_t ev[TRACE_RING];
+};
+struct tracering_t *tracering; /* NULL until tracing is first turned on */
+int tracing = 0;            /* if true, record trace events */
+struct trace_event_t tracecopy[TRACE_RING]; /* events being dumped */
+
+struct hlog_hdr_t {         /* Header of the history log */
+    uint32_t magic;         /* HLOG_MAGIC */
+    uint32_t version;       /* HLOG_VERSION */
+    uint64_t tail;          /* offset of the next free record slot */
+    uint64_t size;          /* size of the file */
+};
+struct hlog_rec_t {         /* One logged command line */
+    uint64_t claim;         /* pid << 32 | text length + 1; set to claim */
+    uint32_t done;          /* HLOG_DONE once the record is written */
+    int32_t status;         /* exit status, or HLOG_RUNNING */
+    int64_t time;           /* when it was started (time(2)) */
+    char text[];            /* the line, NUL-terminated, padded to 8 */
+};
+char *hlog;                 /* the mapped log, NULL if history is off */
+size_t hlogmap;             /* bytes of it we have mapped */
+int hlogfd = -1;            /* the log file */
+uint64_t hlogscanned;       /* offset up to which hents is built */
+uint64_t *hents;            /* offset of each record, in log order */
+int *hsorted;               /* indices into hents, sorted by text */
+int nhents;                 /* number of hents */
+int hentcap;                /* allocated hents and hsorted */
+struct hgram_t {            /* The entries whose text has one trigram */
+    uint32_t gram;          /* its three bytes + 1; 0 for an empty slot */
+    int n;                  /* number of entries, in log order */
+    int cap;                /* allocated ents */
+    int *ents;
+};
+struct hgram_t *hgrams;     /* open-addressed trigram table */
+int hgramcap;               /* its size, a power of 2 */
+int nhgrams;                /* slots in use */
+
+struct argvec_t {           /* A growable argument vector */
+    char **argv;            /* NULL-terminated argument list */
+    char *quoted;           /* WORD_* flags of each argument */
+    int argc;               /* number of arguments */
+    int cap;                /* allocated slots */
+};
+struct argvec_t globargs;   /* argv after wildcard expansion */
+
+char *substbuf;             /* arena holding $(...) output, reused */
+size_t substlen;            /* bytes used in substbuf */
+size_t substcap;            /* bytes allocated for substbuf */
+struct subst_t {            /* Where one substitution's output is */
+    size_t off;             /* offset in substbuf */
+    size_t len;             /* length */
+} substs[MAXSUBST];
+struct argvec_t substargs;  /* argv after substitution */
+char substword[CHUNKSIZE];  /* for gluing output to the text around it */
+
+struct redir_t {            /* An I/O redirection */
+    int fd;                 /* descriptor being redirected */
+    int flags;              /* open(2) flags, or -1 to duplicate dupfd */
+    int dupfd;              /* source of N>&M, or -1 to close fd (N>&-) */
+    char *path;             /* file to open */
+};
+
+struct tshc_hdr_t {         /* Header of a compiled script */
+    uint32_t magic;         /* TSHC_MAGIC */
+    uint32_t version;       /* TSHC_VERSION */
+    uint64_t size;          /* cache key: the script's size, */
+    int64_t mtime_sec;      /*   modification time */
+    int64_t mtime_nsec;
+    uint32_t pathlen;       /*   and path, which follows the header */
+    uint32_t ncmds;         /* number of command records */
+    uint32_t cmdlen;        /* bytes of command records after the path */
+    uint32_t strlen;        /* bytes of strings after the records */
+};
+struct tshc_cmd_t {         /* One pre-parsed command line */
+    uint32_t line;          /* string offset of the original line */
+    uint16_t argc;          /* number of word offsets that follow */
+    uint8_t flags;          /* TSHC_BG, TSHC_RAW */
+    uint8_t nredir;         /* number of tshc_redir_t after the words */
+};
+struct tshc_redir_t {       /* A pre-parsed redirection */
+    int32_t fd;
+    int32_t flags;
+    int32_t dupfd;
+    uint32_t path;          /* string offset of the file name */
+};
+struct buf_t {              /* A growable byte buffer */
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+char *builtins[] = {        /* names of the builtin commands */
+    "quit", "jobs", "bg", "fg", "kill", "wait", "trace", "bench", "history",
+    "true", "false", NULL
+};
+
+struct var_t {              /* A shell variable (set by for) */
+    char name[MAXVARNAME];
+    char value[MAXLINE];
+} vars[MAXVARS];
+int nvars;                  /* number of vars in use */
+
+struct cfnode_t {           /* One command of a compound command */
+    uint32_t text;          /* offset of its text in cftext */
+    int kw;                 /* CF_* keyword, or CF_NONE */
+    int link;               /* the matching do/done/then/elif/else/fi */
+};
+struct buf_t cftext;        /* text of the commands read so far */
+struct buf_t cfnodes;       /* cfnode_t for each of them */
+int ncfnodes;               /* number of cfnodes */
+int cfdepth;                /* open for/while/if, waiting for done/fi */
+int cfabort;                /* ctrl-c or ctrl-z: stop running the block */
+char *cfkeywords[] = {      /* names of the CF_* keywords */
+    "", "for", "while", "if", "do", "done", "then", "elif", "else", "fi", NULL
+};
+
+struct dircache_t {         /* A cached directory listing */
+    dev_t dev;              /* cache key: device, */
+    ino_t ino;              /*   inode */
+    struct timespec mtime;  /*   and modification time */
+    char *names;            /* packed entries: type, length, name, NUL */
+    size_t len;             /* bytes used in names */
+    size_t cap;             /* bytes allocated for names */
+    int busy;               /* listing is being walked; don't evict it */
+};
+struct dircache_t dircache[MAXDIRCACHE]; /* listings read by this line */
+int ndircache = 0;          /* number of valid dircache entries */
+int nextdircache = 0;       /* next entry to evict when the cache is full */
+
+struct chunk_t {            /* A chunk of the per-line string arena */
+    struct chunk_t *next;
+    size_t used;
+    char data[CHUNKSIZE];
+};
+struct chunk_t *chunks;     /* first chunk of the string arena */
+struct chunk_t *curchunk;   /* chunk currently being filled */
+
+struct dirent64_t {         /* Record returned by getdents64 */
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+long globbuf[GLOBBUFSIZE / sizeof(long)]; /* getdents64 buffer */
+
+struct patop_t {            /* One operation of a compiled pattern */
+    unsigned char op;       /* PAT_CHAR, PAT_ANY, PAT_STAR, ... */
+    unsigned char arg;      /* the character, or the index of the set */
+};
+struct pat_t {              /* A compiled path component pattern */
+    struct patop_t ops[NAME_MAX + 2];
+    unsigned char sets[MAXGLOBSETS][32]; /* 256-bit character sets */
+    int nsets;
+};
+struct pat_t globpats[MAXGLOBDEPTH]; /* patterns of the word being expanded */
 /* End global variables */
 
 
@@ -36,8 +244,21 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Hrere are the functions that you will implement */
 void eval(char *cmdline);
-int builtin_cmd(char **argv);
+void evalargs(char *cmdline, struct argvec_t *args, int bg,
+              struct redir_t *redirs, int nredir);
+pid_t launch(char **argv, struct redir_t *redirs, int nredir, int state,
+             char *cmdline);
+int builtin_cmd(char **argv, struct redir_t *redirs, int nredir);
 void do_bgfg(char **argv);
+void do_kill(char **argv);
+void do_wait(char **argv);
+int jobselect(char *cmd, char **specs, struct jobsel_t *sel);
+int jobspec(char *cmd, char *spec, char *mark);
+void do_trace(char **argv);
+void do_bench(char **argv);
+void do_history(char **argv);
+int llcmp(const void *a, const void *b);
+int intcmp(const void *a, const void *b);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
@@ -56,7 +277,17 @@ pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
+unsigned pidhash(pid_t pid);
+int pidfind(pid_t pid);
+void piddelete(int slot);
 void listjobs(struct job_t *jobs);
+void jobsbegin(void);
+void jobsend(void);
+void setjobstate(struct job_t *job, int state);
+void jobkill(pid_t pid, int sig);
+int jobnamecmp(int a, int b);
+int jobnamefind(const char *prefix);
+void jobcurrent(int jid);
 
 void usage(void);
 void unix_error(char *msg);
@@ -66,6 +297,95 @@ handler_t *Signal(int signum, handler_t *handler);
 void listbgjobs(struct job_t *jobs);
 int pidexist(pid_t pid, struct job_t *jobs);
 
+/* Argument vectors and wildcard expansion */
+void quotemask(const char *cmdline, char *quoted);
+void argvpush(struct argvec_t *av, char *arg, int quoted);
+void argvclear(struct argvec_t *av);
+char *strsave(const char *s, size_t len);
+int patcompile(const char *s, struct pat_t *pat);
+int patmatch(const struct pat_t *pat, const char *s);
+struct dircache_t *dirlist(const char *path);
+int argcmp(const void *a, const void *b);
+void globwalk(char *path, size_t plen, char **comp, struct pat_t **pats,
+              int i, int n, int mustexist, struct argvec_t *out);
+void globword(char *word, struct argvec_t *out);
+struct argvec_t *globargv(struct argvec_t *av);
+void globreset(void);
+
+/* I/O redirection */
+int isbuiltin(char *name);
+int parseredir(struct argvec_t *av, struct redir_t *redirs);
+int applyredirs(struct redir_t *redirs, int nredir);
+int redirsave(struct redir_t *redirs, int nredir, int *saved);
+void redirrestore(struct redir_t *redirs, int nredir, int *saved);
+int fastcopy(char **argv, struct redir_t *redirs, int nredir);
+
+/* Command substitution */
+int substline(const char *cmdline, char *line);
+void substgrow(void);
+int runsubst(char *text);
+struct argvec_t *substargv(struct argvec_t *av, int nsubst);
+
+/* Compiled scripts */
+size_t bufput(struct buf_t *b, const void *p, size_t n);
+int tshcompile(const char *name, const char *text, size_t size,
+               struct buf_t *cmds, struct buf_t *strs);
+void tshcrun(const char *cmds, uint32_t ncmds, const char *strs);
+int tshccheck(const char *cmds, uint32_t ncmds, uint32_t cmdlen,
+              const char *strs, uint32_t strslen);
+char *tshcmap(const char *cache, const char *path, struct stat *sb,
+              size_t *len);
+void tshcwrite(const char *cache, const char *path, struct stat *sb,
+               int ncmds, struct buf_t *cmds, struct buf_t *strs);
+void runscript(char *script);
+
+/* Metrics endpoint */
+long long nsnow(void);
+void histadd(unsigned long *hist, long long ns);
+void metricsinit(char *path);
+int metricsstale(struct sockaddr_un *addr);
+void metricsexit(void);
+void *metricsloop(void *arg);
+int jobsnapshot(struct job_t *snap);
+void metricsserve(int fd);
+
+/* Event tracing */
+void traceinit(void);
+void traceev(int type, pid_t pid, int arg);
+void tracedump(char *file);
+
+/* Command history */
+void hloginit(void);
+int hlogroom(uint64_t end);
+uint64_t hlogrecsize(uint32_t len);
+uint64_t hlogappend(const char *line);
+void hlogdone(uint64_t off, int status);
+void hlogindex(void);
+char *hlogtext(int i);
+int hentcmp(const void *a, const void *b);
+int hlogprefix(const char *prefix);
+struct hgram_t *hgramfind(const char *s, int add);
+void hgramadd(int i);
+int hlogexpand(char *cmdline);
+void hlogprint(int i, int verbose);
+int exitcode(int status);
+
+/* Control flow */
+int varref(const char **pp, const char **val);
+int varexpand(const char *in, char *out);
+char *getvar(const char *name, size_t len);
+void setvar(const char *name, const char *value);
+int cfkeyword(const char *s);
+void cfpush(const char *s, size_t len);
+void cfsplit(const char *s, size_t len);
+int cfamp(const char *line);
+int cfline(char *line);
+int cflink(struct cfnode_t *nodes);
+void cfexec(struct cfnode_t *nodes, int i, int end);
+void cffor(struct cfnode_t *nodes, int i);
+void cfsimple(char *cmd);
+void cfreset(void);
+
 /*
  * main - The shell's main routine 
  */
@@ -75,13 +395,15 @@ int main(int argc, char **argv)
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
+    char *metricspath = NULL; /* metrics socket (-m) */
+    uint64_t histoff;         /* log record of the line being run */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpm:t")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -92,6 +414,13 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'm':             /* serve metrics on a unix socket */
+            metricspath = optarg;
+	    break;
+        case 't':             /* record trace events from the start */
+            traceinit();
+            tracing = 1;
+	    break;
 	default:
             usage();
 	}
@@ -109,26 +438,46 @@ int main(int argc, char **argv)
 
     /* Initialize the job list */
     initjobs(jobs);
+    if (metricspath != NULL)
+        metricsinit(metricspath);
+    hloginit();
+
+    /* Run a script instead of reading commands from stdin */
+    if (optind < argc) {
+        runscript(argv[optind]);
+        fflush(stdout);
+        exit(0);
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
         
 	/* Read command line */
 	if (emit_prompt) {
-	    printf("%s", prompt);
+	    printf("%s", cfdepth > 0 ? "> " : prompt);
 	    fflush(stdout);
 	}
 	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
 	    app_error("fgets error");
 	if (feof(stdin)) { /* End of file (ctrl-d) */
+	    if (cfdepth > 0)
+		printf("syntax error: unexpected end of file\n");
 	    fflush(stdout);
 	    exit(0);
 	}
+	traceev(EV_LINE, 0, 0);
+
+	/* Expand !n, !prefix and !!, and log what will run */
+	if (!hlogexpand(cmdline))
+	    continue;
+	histoff = hlogappend(cmdline);
 
 	/* Evaluate the command line */
 	
-        eval(cmdline);
-        
+        if (!cfline(cmdline))
+            eval(cmdline);
+        globreset();
+        hlogdone(histoff, laststatus);
 
         
 	fflush(stdout);
@@ -152,215 +501,758 @@ int main(int argc, char **argv)
 */
 void eval(char *cmdline) 
 {
-    int jid = 0;
-    pid_t pid;
-    sigset_t mask;
     // cmdline is a pointer to the command line string (char array)
-    char *argv[MAXARGS]; /* argv for execve() */
+    char line[MAXLINE];  /* cmdline with the substitutions marked */
+    char *words[MAXARGS]; /* words as split by parseline */
+    char quoted[MAXARGS]; /* which of those words were quoted */
+    struct argvec_t args, *xargs;
+    struct redir_t redirs[MAXREDIRS];
+    int nsubst, nredir;
                          // call int bg = parseline(cmdline, argv);  
                          // to parse command line arguments into argv 
                          // that you can pass to execve
+
+    // Run the $(...) substitutions and look up the variables. Their
+    // values replace marks left in line once it has been split into
+    // words.
+    if ((nsubst = substline(cmdline, line)) < 0) {
+      laststatus = 1;
+      return;
+    }
     
     /* Parse command line */
-    int bg = parseline(cmdline, argv); /* bg=1:bg; bg=0:fg */
+    int bg = parseline(nsubst ? line : cmdline, words); /* bg=1:bg; bg=0:fg */
     //printf("bg: %d\n",bg);
-    if (argv[0] == NULL) {
+    if (words[0] == NULL) {
       return; /* Empty line - ignore it */
     }
 
+    // Pull the redirections out of the words.
+    quotemask(nsubst ? line : cmdline, quoted);
+    args.argv = words;
+    args.quoted = quoted;
+    for (args.argc = 0; words[args.argc] != NULL; args.argc++)
+      ;
+    args.cap = MAXARGS;
+    xargs = nsubst ? substargv(&args, nsubst) : &args;
+    if ((nredir = parseredir(xargs, redirs)) < 0) {
+      fprintf(stderr, "%s", sbuf);
+      laststatus = 1;
+      return;
+    }
 
-    // If argv is a built-in command, execute it immediately and return
-    if (!builtin_cmd(argv)) {
-      // Fork a child process which runs job. block the sigchild signal until
-      // added to the job list, so that a child that ends quickly doesn't 
-      // cause a segfault by deleting a job that doesn't exist.
-      
-      sigemptyset(&mask);
-      sigaddset(&mask, SIGCHLD);
-
-      sigprocmask(SIG_BLOCK, &mask, NULL);
-      if ((pid = fork()) == 0) {
-        // This is the child process
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    evalargs(cmdline, xargs, bg, redirs, nredir);
+}
 
-        //Sets group pid to the value of the parent's PID.
-        setpgid(0,0);
+/*
+ * evalargs - Run a command line that has already been split into words
+ *    and redirections: expand wildcards in the unquoted words, then
+ *    run a builtin in the shell or launch a job. Cached scripts come
+ *    in here directly, skipping parseline.
+ */
+void evalargs(char *cmdline, struct argvec_t *args, int bg,
+              struct redir_t *redirs, int nredir)
+{
+    int jid = 0;
+    pid_t pid;
+    sigset_t mask;
+    int saved[MAXREDIRS];
+    char **argv;         /* argv for execve() */
 
-        //If there's an execve error, that means the command doesn't exist.
-        if (execve(argv[0], argv, environ) < 0) {
-          printf("%s: Command not found. \n", argv[0]);
-        } 
+    traceev(EV_PARSE, 0, 0);
+    laststatus = 0;
+    if (args->argc == 0) {
+      // Only redirections (e.g. "> file"): create or truncate the files.
+      if (redirsave(redirs, nredir, saved) == 0) {
+        redirrestore(redirs, nredir, saved);
       }
+      return;
+    }
+
+    // Words without wildcards are passed through without being copied.
+    argv = globargv(args)->argv;
+
+    // "cat < a > b" is copied in-process without starting cat at all.
+    if (!bg && fastcopy(argv, redirs, nredir)) {
+      return;
+    }
+
+    // If argv is a built-in command, execute it immediately and return
+    if (!builtin_cmd(argv, redirs, nredir)) {
+      // launch returns with SIGCHLD (and SIGINT, SIGTSTP) still blocked,
+      // so a child that ends quickly can't be reaped before we are done
+      // with its job entry.
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGCHLD);
+      sigaddset(&mask, SIGINT);
+      sigaddset(&mask, SIGTSTP);
+      fgstatus = 0;
+      pid = launch(argv, redirs, nredir, bg ? BG : FG, cmdline);
       
       if (!bg) {
       /* This is the parent process */
         // Run process in foreground
         // use waitfg to wait for child process to terminate
         // proceed to next iteration upon termination of child process
-        // block SIGCHILD signal until after job is added 
-        
-      
-        addjob(jobs, pid, FG, cmdline);
         sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        
-       
         waitfg(pid);
+        laststatus = exitcode(fgstatus);
 
       } 
       else {
         // Run process in background
         // return to top of loop, await next command line entry
-        // TODO: Get the jid of new job with that helper function
-        //printf("Run in background\n");
-        //
-        //
-        // We've added to the list, so now it's safe to unblock the
-        // sigchld process.
-        addjob(jobs, pid, BG, cmdline);
+        jid = pid2jid(pid);
         sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        jid = getjobpid(jobs, pid)->jid;
 
         // Display information about the command.
         printf("[%d] (%d) %s", jid, pid, cmdline);
         
       }
     }
-    
-    
+}
+
+/*
+ * launch - Fork a child that applies redirs and execs argv, and add it
+ *    to the job list in the given state. Returns the child's pid with
+ *    SIGCHLD, SIGINT and SIGTSTP blocked; the caller unblocks them once
+ *    it is done with the job's entry. Each child gets its own process group so that it
+ *    only sees ctrl-c (ctrl-z) when we forward it.
+ */
+pid_t launch(char **argv, struct redir_t *redirs, int nredir, int state,
+             char *cmdline)
+{
+    pid_t pid;
+    sigset_t mask;
+    long long forkns = metrics ? nsnow() : 0;
+
+    // Block the sigchild signal until added to the job list, so that a
+    // child that ends quickly doesn't cause a segfault by deleting a job
+    // that doesn't exist. Ctrl-c and ctrl-z wait too, for the handlers
+    // would otherwise see a half-added job.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+
+    // Flush first so the child doesn't inherit (and repeat) our output.
+    fflush(stdout);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((pid = fork()) < 0) {
+      unix_error("fork error");
+    }
+    if (pid == 0) {
+      // This is the child process
+      traceev(EV_FORK, getpid(), 0);
+      sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+      //Sets group pid to the value of the parent's PID.
+      setpgid(0,0);
+
+      // Set up the redirections between fork and execve.
+      if (applyredirs(redirs, nredir) < 0) {
+        _exit(1);
+      }
+
+      // The metrics page is shared, so the child can time its own exec.
+      if (metrics) {
+        histadd(metrics->forkexec, nsnow() - forkns);
+      }
+      traceev(EV_EXEC, getpid(), 0);
+
+      //If there's an execve error, that means the command doesn't exist.
+      // _exit, not exit: exit would flush our copy of stdin's buffer,
+      // seeking the shared input back so the shell rereads lines.
+      if (execve(argv[0], argv, environ) < 0) {
+        fprintf(stderr, "%s: Command not found. \n", argv[0]);
+        _exit(1);
+      } 
+    }
+
+    // The child's own EV_FORK races with our next line, so the decoder
+    // ties the child to its command line through this event instead.
+    traceev(EV_SPAWN, pid, 0);
+
+    // Set the group here too, so a kill or fg right after this can't
+    // reach the child before it has got around to setpgid itself.
+    setpgid(pid, pid);
+    addjob(jobs, pid, state, cmdline);
+    return pid;
 }
 
 /* 
  * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+ *    it immediately. Builtins run inside the shell, so their
+ *    redirections are applied by swapping file descriptors for the
+ *    duration of the command instead of by forking.
  */
-int builtin_cmd(char **argv) 
+int builtin_cmd(char **argv, struct redir_t *redirs, int nredir) 
 {
+    int saved[MAXREDIRS];
     
     // if cmdline represents built-in command, execute it immediately
     // else fork a child process and run the job in the context of the
     // child (outside this function)
+    if (!isbuiltin(argv[0])) {
+      return 0;     /* not a builtin command */
+    }
+    if (redirsave(redirs, nredir, saved) < 0) {
+      return 1;
+    }
+
     if (!(strcmp(argv[0],"quit"))) {
       exit(0); 
     } else if (!strcmp(argv[0],"jobs")) {
           // List all jobs running in background
           listjobs(jobs);
-          return 1;
     } else if (!strcmp(argv[0],"bg")) {
           // Check for PID or JID argument
           do_bgfg(argv);
           // Restart <job> by sending SIGCONT signal, runs job in background
-          return 1;
     } else if (!strcmp(argv[0],"fg")) {
           // Check for PID of JID argument
           do_bgfg(argv);
           // Restart <job> by sending SIGCONT signal, runs job in foreground
-          return 1;
+    } else if (!strcmp(argv[0],"kill")) {
+          // Send a signal to jobs
+          do_kill(argv);
+    } else if (!strcmp(argv[0],"wait")) {
+          // Wait for background jobs to finish
+          do_wait(argv);
+    } else if (!strcmp(argv[0],"trace")) {
+          // Turn event tracing on or off, or dump the ring
+          do_trace(argv);
+    } else if (!strcmp(argv[0],"bench")) {
+          // Time repeated runs of a command line
+          do_bench(argv);
+    } else if (!strcmp(argv[0],"history")) {
+          // List or search the command history
+          do_history(argv);
+    } else if (!strcmp(argv[0],"true")) {
+          laststatus = 0;
+    } else if (!strcmp(argv[0],"false")) {
+          laststatus = 1;
     }
-    return 0;     /* not a builtin command */
+
+    redirrestore(redirs, nredir, saved);
+    return 1;
   }
 /* 
- * do_bgfg - Execute the builtin bg and fg commands
+ * do_bgfg - Execute the builtin bg and fg commands:
+ *    bg job...  fg job...
+ *    bg continues the jobs in the background. fg continues them in the
+ *    foreground one at a time, in JID order, and stops early if one is
+ *    stopped or killed by a signal.
  */
 void do_bgfg(char **argv) 
 {
-    pid_t pid_1;
-    int temp2;
-    int length,i;
-    length  = strlen(argv[1]);
-    char temp[length];
-    struct job_t *currentjob; 
-    int is_jid;
-    is_jid = 0;
-    // TODO: Implement this function
-    // If given jid, get pid from jid
-    // If job is already in bg, don't necessarily need to do anything
-    // If bringing job into fg, change state in joblist, restart in fg 
-    // with SIGCONT If sending job to the background from fg, stop with SIGSTP,
-    // start it again with SIGCONT...and also change state in job struct
+    struct jobsel_t sel[MAXJOBS];
+    struct job_t *job;
+    sigset_t mask, prev;
+    int i, n;
+    pid_t pid;
 
-    
-    
     //Check to see if the user passed a jid/pid to bg/fg 
-    if(argv[1] == NULL || *argv[1] == ' '){
-      printf("%s command requires PID or %%jobid argument\n",argv[0]);
+    if (argv[1] == NULL) {
+      printf("%s command requires PID or %%jobid argument\n", argv[0]);
       return;
     }
 
-    // Handles a call using a jid, indicated by %jid
+    // Keep the handlers from changing the job list while we look jobs
+    // up and change their states.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if ((n = jobselect(argv[0], argv + 1, sel)) < 0) {
+      sigprocmask(SIG_SETMASK, &prev, NULL);
+      return;
+    }
 
-    if(argv[1][0] =='%'){
-       is_jid = 1;
-      // Copies every element of the jid except the %, then null terminates it.
-      for(i=1; i<length;i++){
-        temp[i-1] = argv[1][i];
+    for (i = 0; i < n; i++) {
+      job = &jobs[sel[i].slot];
+      if (job->pid != sel[i].pid)
+        continue;   /* it ended while an earlier job ran in the fg */
+      pid = job->pid;
+      if (!strcmp("bg", argv[0])) {
+        // Restarts the job in the background
+        setjobstate(job, BG);
+        jobkill(pid, SIGCONT);
+        printf("[%d] (%d) %s", job->jid, pid, job->cmdline);
+        continue;
       }
-      temp[length-1] = '\0';
-      // Turns the char into an int.
-      temp2 = atoi(temp);
-      
-            
-   }else{
-
-      temp2 = atoi(argv[1]);    
-   }
-     // Error checking to see if the JID/PID actually exists.
-     // If it's a JID, check to see if it's in the range of the job list
-      if(is_jid && (temp2 > maxjid(jobs)||temp2<0)){
-        printf("%s: No such job.\n",argv[1]);
+
+      // Runs the job in the foreground by restarting it, changing its
+      // state to FG, then waiting for it to finish or stop.
+      fgstatus = 0;
+      setjobstate(job, FG);
+      jobkill(pid, SIGCONT);
+      sigprocmask(SIG_SETMASK, &prev, NULL);
+      waitfg(pid);
+      sigprocmask(SIG_BLOCK, &mask, NULL);
+      if (WIFSIGNALED(fgstatus) || WIFSTOPPED(fgstatus))
+        break;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_kill - Execute the builtin kill command:
+ *    kill [-signal] job...
+ *    Sends signal (a number or name, SIGTERM by default) to each job.
+ */
+void do_kill(char **argv)
+{
+    struct jobsel_t sel[MAXJOBS];
+    sigset_t mask, prev;
+    int i, n, sig = SIGTERM;
+    char *name, *end;
+    const char *abbrev;
+
+    if (argv[1] != NULL && argv[1][0] == '-') {
+      name = argv[1] + 1;
+      if (!strncmp(name, "SIG", 3))
+        name += 3;
+      sig = strtol(name, &end, 10);
+      if (end == name || *end != '\0') {
+        for (sig = 1; sig < NSIG; sig++)
+          if ((abbrev = sigabbrev_np(sig)) != NULL && !strcmp(abbrev, name))
+            break;
+      }
+      if (sig < 1 || sig >= NSIG) {
+        printf("%s: %s: invalid signal specification\n", argv[0], argv[1]);
         return;
       }
-    // If it's a PID, make sure it is a PID that actually exists.  
+      argv++;
+    }
+    if (argv[1] == NULL) {
+      printf("kill: usage: kill [-signal] PID | %%jobid...\n");
+      return;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    n = jobselect("kill", argv + 1, sel);
+    for (i = 0; i < n; i++) {
+      jobkill(sel[i].pid, sig);
+      // A stopped job can't act on TERM or HUP until it runs again.
+      if ((sig == SIGTERM || sig == SIGHUP) &&
+          jobs[sel[i].slot].state == ST)
+        jobkill(sel[i].pid, SIGCONT);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_wait - Execute the builtin wait command:
+ *    wait [job...]
+ *    Waits until the jobs (all background jobs by default) have
+ *    finished or stopped, or until ctrl-c is typed.
+ */
+void do_wait(char **argv)
+{
+    struct jobsel_t sel[MAXJOBS];
+    sigset_t mask, prev, waitmask;
+    struct job_t *job;
+    int i, n = 0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (argv[1] != NULL) {
+      n = jobselect(argv[0], argv + 1, sel);
+    } else {
+      for (i = 1; i <= MAXJOBS; i++) {
+        if (jidslot[i] && jobs[jidslot[i] - 1].state == BG) {
+          sel[n].slot = jidslot[i] - 1;
+          sel[n++].pid = jobs[jidslot[i] - 1].pid;
+        }
+      }
+    }
+
+    // As in waitfg, SIGCHLD stays blocked except inside sigsuspend.
+    // So does SIGINT, or a ctrl-c just after the check would be lost.
+    waitmask = prev;
+    sigdelset(&waitmask, SIGCHLD);
+    sigdelset(&waitmask, SIGINT);
+    interrupted = 0;
+    for (i = 0; i < n && !interrupted; ) {
+      job = &jobs[sel[i].slot];
+      if (job->pid == sel[i].pid && job->state == BG)
+        sigsuspend(&waitmask);
+      else
+        i++;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * jobselect - Look up the jobs named by specs, a NULL-terminated list
+ *    of job specifiers (see jobspec), and store them in sel in JID
+ *    order. Returns the number of jobs, or -1 with a message if some
+ *    specifier names no job. Call with SIGCHLD blocked.
+ */
+int jobselect(char *cmd, char **specs, struct jobsel_t *sel)
+{
+    char mark[MAXJOBS + 1];
+    int i, n = 0;
+
+    memset(mark, 0, sizeof(mark));
+    for (i = 0; specs[i] != NULL; i++)
+      if (jobspec(cmd, specs[i], mark) < 0)
+        return -1;
+    for (i = 1; i <= MAXJOBS; i++) {
+      if (mark[i]) {
+        sel[n].slot = jidslot[i] - 1;
+        sel[n++].pid = jobs[jidslot[i] - 1].pid;
+      }
+    }
+    return n;
+}
+
+/*
+ * jobspec - Set mark[jid] for each job that spec names:
+ *    PID          the job with that process ID
+ *    %n           job n
+ *    %n..%m       jobs n through m that exist
+ *    %+, %%, %    the current job, the one most recently started or
+ *                 stopped
+ *    %-           the previous job
+ *    %name        the job whose command line starts with name
+ *    %?text       the job whose command line contains text
+ *    Returns -1, with a message, if there is no such job or more than
+ *    one job matches %name or %?text.
+ */
+int jobspec(char *cmd, char *spec, char *mark)
+{
+    struct job_t *job;
+    char *p = spec + 1, *end;
+    long lo, hi;
+    int i, jid = 0, matches = 0;
+    size_t len;
 
-      else if( (!is_jid)&&(pidexist(temp2,jobs)==0)){
-        printf("%s: No such job.\n",argv[1]);
+    if (spec[0] != '%') {
+      lo = strtol(spec, &end, 10);
+      if (!isdigit(spec[0]) || *end != '\0') {
+        printf("%s: argument must be a PID or %%jobid\n", cmd);
+        return -1;
       }
-    // When we do atoi, c turns any characters that aren't ascii
-    // equivalents of integers into 0's. So we can use this
-    // to check to see if a character was passed into fg/bg instead
-    // of an int.
-      else if(!temp2){
-        printf("%s: argument must be a PID or %%jobid\n",argv[0]);
-        return;
+      if (lo > INT_MAX || (job = getjobpid(jobs, lo)) == NULL) {
+        printf("(%s): No such process\n", spec);
+        return -1;
       }
-      
-      // Gets job based on jid or pid
-      if(is_jid){
-        currentjob = getjobjid(jobs,temp2);
-      }else{
-        currentjob = getjobpid(jobs,temp2);
+      mark[job->jid] = 1;
+      return 0;
+    }
+
+    if (isdigit(*p)) {
+      lo = hi = strtol(p, &end, 10);
+      if (end[0] == '.' && end[1] == '.') {
+        p = end + 2 + (end[2] == '%');
+        hi = strtol(p, &end, 10);
+        if (!isdigit(*p))
+          end = p;
       }
-      
-      pid_1 = currentjob->pid;
+      if (*end != '\0') {
+        printf("%s: argument must be a PID or %%jobid\n", cmd);
+        return -1;
+      }
+      for (jid = lo < 1 ? 1 : lo, i = 0; jid <= hi && jid <= MAXJOBS; jid++)
+        if (jidslot[jid])
+          mark[jid] = i = 1;
+      if (!i) {
+        printf("%s: No such job\n", spec);
+        return -1;
+      }
+      return 0;
+    }
+
+    if (*p == '\0' || !strcmp(p, "+") || !strcmp(p, "%")) {
+      jid = curjid;
+    } else if (!strcmp(p, "-")) {
+      jid = prevjid;
+    } else if (*p == '?') {
+      // No index helps with a substring; check every job.
+      for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].pid != 0 && strstr(jobs[i].cmdline, p + 1) != NULL) {
+          jid = jobs[i].jid;
+          matches++;
+        }
+      }
+    } else {
+      // The jobs starting with p are adjacent in jobnames, so it's
+      // enough to look at the first two.
+      len = strlen(p);
+      for (i = jobnamefind(p); i < njobnames && matches < 2 &&
+           !strncmp(jobs[jobnames[i]].cmdline, p, len); i++) {
+        jid = jobs[jobnames[i]].jid;
+        matches++;
+      }
+    }
+    if (matches > 1) {
+      printf("%s: ambiguous job spec\n", spec);
+      return -1;
+    }
+    if (jid == 0) {
+      printf("%s: No such job\n", spec);
+      return -1;
+    }
+    mark[jid] = 1;
+    return 0;
+}
 
+/*
+ * do_trace - Execute the builtin trace command:
+ *    trace [on | off | clear | dump [file]]
+ */
+void do_trace(char **argv)
+{
+    if (argv[1] == NULL) {
+      printf("trace is %s, %lu events recorded\n", tracing ? "on" : "off",
+             tracering ? tracering->head - tracering->tail : 0);
+    } else if (!strcmp(argv[1], "on")) {
+      traceinit();
+      tracing = 1;
+    } else if (!strcmp(argv[1], "off")) {
+      tracing = 0;
+    } else if (!strcmp(argv[1], "clear")) {
+      // Children may be writing into the ring, so leave the slots
+      // alone and just skip what came before.
+      if (tracering) {
+        __atomic_store_n(&tracering->tail,
+                         __atomic_load_n(&tracering->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+      }
+    } else if (!strcmp(argv[1], "dump")) {
+      tracedump(argv[2]);
+    } else {
+      printf("%s: usage: trace [on | off | clear | dump [file]]\n", argv[0]);
+    }
+}
 
-    // Restarts bg job if command is bg <job>
-    if(currentjob->state==BG && !strcmp("bg",argv[0])){
-      kill(currentjob->pid*-1,SIGCONT);
-      printf("[%d] (%d) %s",currentjob->jid, currentjob->pid,
-          currentjob->cmdline);
-      return;      
+/*
+ * do_bench - Execute the builtin bench command:
+ *    bench -n N [-w warmup] command...
+ *    Runs command warmup + N times, with its words as they were after
+ *    the bench line itself was expanded, and reports the wall time of
+ *    the timed runs and the CPU time they used. Stops early if a run is
+ *    stopped or killed.
+ */
+void do_bench(char **argv)
+{
+    char cmd[MAXLINE], *text, *p;
+    struct argvec_t args;
+    struct rusage child0, child1, self0, self1;
+    long long *ns, t0, sum = 0, val;
+    int i, j, n = 0, warmup = 0, runs, len = 0;
+    size_t size = 1;
+    char *end;
 
-    // Runs the given job in the foreground by restarting the job, changing
-    // its state to FG, then making it wait for all child processes to finish.
-    } else if(!strcmp("fg",argv[0])){
-      
-      kill(currentjob->pid*-1,SIGCONT);
-      currentjob->state = FG;
-      waitfg(currentjob->pid);
-
-    // Runs in the background by stopping the job, then restarting it
-    // and updating its status.
-    } else if(!strcmp("bg",argv[0])){
-      currentjob->state=BG;
-      kill(currentjob->pid*-1,SIGSTOP);
-      kill(currentjob->pid*-1,SIGCONT);
-      printf("[%d] (%d) %s",currentjob->jid, currentjob->pid,
-          currentjob->cmdline);
-    } 
-    
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+      if (argv[i + 1] == NULL ||
+          (strcmp(argv[i], "-n") && strcmp(argv[i], "-w"))) {
+        break;
+      }
+      val = strtoll(argv[i + 1], &end, 10);
+      if (end == argv[i + 1] || *end != '\0' || val < 0 || val > INT_MAX) {
+        val = -1;
+      }
+      if (argv[i][1] == 'n') {
+        n = val;
+      } else {
+        warmup = val;
+      }
+    }
+    if (n < 1 || warmup < 0 || argv[i] == NULL || argv[i][0] == '-') {
+      printf("%s: usage: bench -n N [-w warmup] command...\n", argv[0]);
+      laststatus = 1;
+      return;
+    }
+    // One slot per timed run; a huge N is an error, not an exit.
+    if ((size_t)n > SIZE_MAX / sizeof(long long) ||
+        (ns = malloc(n * sizeof(long long))) == NULL) {
+      printf("%s: -n %d: %s\n", argv[0], n, strerror(ENOMEM));
+      laststatus = 1;
+      return;
+    }
 
-   
-   return;
+    // Our words have already been split, substituted and globbed once;
+    // doing any of that again would run something other than what was
+    // typed. They live in buffers the command reuses, so copy them and
+    // mark every copy quoted. The line is only for display.
+    args.argc = 0;
+    args.cap = 1;
+    for (j = i; argv[j] != NULL; j++) {
+      args.cap++;
+      size += strlen(argv[j]) + 1;
+    }
+    args.argv = malloc(args.cap * sizeof(char *));
+    args.quoted = malloc(args.cap);
+    text = malloc(size);
+    if (args.argv == NULL || args.quoted == NULL || text == NULL) {
+      printf("%s: %s\n", argv[0], strerror(ENOMEM));
+      free(args.argv);
+      free(args.quoted);
+      free(text);
+      free(ns);
+      laststatus = 1;
+      return;
+    }
+    for (p = text; argv[i] != NULL; i++) {
+      args.argv[args.argc] = strcpy(p, argv[i]);
+      args.quoted[args.argc++] = WORD_QUOTED;
+      p += strlen(p) + 1;
+      if (len < MAXLINE - 4) {
+        len += snprintf(cmd + len, MAXLINE - 4 - len,
+                        strchr(argv[i], ' ') ? "'%s' " : "%s ", argv[i]);
+      }
+    }
+    args.argv[args.argc] = NULL;
+    if (len > MAXLINE - 4) {
+      len = MAXLINE - 4;
+    }
+    cmd[len - 1] = '\n';
+    cmd[len] = '\0';
+
+    getrusage(RUSAGE_CHILDREN, &child0);
+    getrusage(RUSAGE_SELF, &self0);
+    for (runs = -warmup; runs < n; runs++) {
+      fgstatus = 0;
+      t0 = nsnow();
+      evalargs(cmd, &args, 0, NULL, 0);
+      if (runs >= 0) {
+        ns[runs] = nsnow() - t0;
+        sum += ns[runs];
+      }
+      globreset();
+      fflush(stdout);
+      if (WIFSIGNALED(fgstatus) || WIFSTOPPED(fgstatus)) {
+        runs++;
+        break;
+      }
+    }
+    getrusage(RUSAGE_CHILDREN, &child1);
+    getrusage(RUSAGE_SELF, &self1);
+    free(args.argv);
+    free(args.quoted);
+    free(text);
+    if (runs > n) {
+      runs = n;
+    }
+
+    if (runs <= 0) {
+      printf("bench: no timed runs completed\n");
+      free(ns);
+      return;
+    }
+    qsort(ns, runs, sizeof(long long), llcmp);
+    printf("bench: %d runs of %s", runs, cmd);
+    printf("  min %.1fus  mean %.1fus  p50 %.1fus  p99 %.1fus  max %.1fus\n",
+           ns[0] / 1e3, (double)sum / runs / 1e3, ns[(runs + 1) / 2 - 1] / 1e3,
+           ns[(runs * 99 + 99) / 100 - 1] / 1e3, ns[runs - 1] / 1e3);
+    printf("  cpu children user %.3fs sys %.3fs, shell user %.3fs sys %.3fs\n",
+           (child1.ru_utime.tv_sec - child0.ru_utime.tv_sec) +
+           (child1.ru_utime.tv_usec - child0.ru_utime.tv_usec) / 1e6,
+           (child1.ru_stime.tv_sec - child0.ru_stime.tv_sec) +
+           (child1.ru_stime.tv_usec - child0.ru_stime.tv_usec) / 1e6,
+           (self1.ru_utime.tv_sec - self0.ru_utime.tv_sec) +
+           (self1.ru_utime.tv_usec - self0.ru_utime.tv_usec) / 1e6,
+           (self1.ru_stime.tv_sec - self0.ru_stime.tv_sec) +
+           (self1.ru_stime.tv_usec - self0.ru_stime.tv_usec) / 1e6);
+    free(ns);
+}
+
+/* llcmp - qsort comparison for long longs */
+int llcmp(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* intcmp - qsort comparison for ints */
+int intcmp(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * do_history - Execute the builtin history command:
+ *    history [-v] [n | -p prefix | -s substring]
+ *    Lists the last n logged command lines (all of them by default),
+ *    or the ones that start with prefix or contain substring. With -v,
+ *    also shows when each line was started and its exit status.
+ */
+void do_history(char **argv)
+{
+    struct hgram_t *g, *best;
+    char *arg, *text;
+    int i, n, lo, *match;
+    int verb = 0;
+    size_t j, len;
+
+    if (hlog == NULL) {
+        printf("%s: history is off\n", argv[0]);
+        return;
+    }
+    hlogindex();
+    i = 1;
+    if (argv[i] != NULL && !strcmp(argv[i], "-v")) {
+        verb = 1;
+        i++;
+    }
+
+    if (argv[i] == NULL) {
+        for (n = 0; n < nhents; n++)
+            hlogprint(n, verb);
+    } else if (argv[i + 1] == NULL && isdigit(argv[i][0])) {
+        n = atoi(argv[i]);
+        for (n = n < nhents ? nhents - n : 0; n < nhents; n++)
+            hlogprint(n, verb);
+    } else if (argv[i + 1] != NULL && argv[i + 2] == NULL &&
+               !strcmp(argv[i], "-p")) {
+        // The matches are one run of the sorted index; list them in
+        // log order.
+        arg = argv[i + 1];
+        len = strlen(arg);
+        if ((match = malloc((nhents + 1) * sizeof(int))) == NULL)
+            unix_error("malloc error");
+        for (lo = hlogprefix(arg), n = 0;
+             lo + n < nhents && !strncmp(hlogtext(hsorted[lo + n]), arg, len);
+             n++)
+            match[n] = hsorted[lo + n];
+        qsort(match, n, sizeof(int), intcmp);
+        for (i = 0; i < n; i++)
+            hlogprint(match[i], verb);
+        free(match);
+    } else if (argv[i + 1] != NULL && argv[i + 2] == NULL &&
+               !strcmp(argv[i], "-s")) {
+        // Only the entries with the substring's rarest trigram can
+        // match; shorter substrings have to look at every entry.
+        arg = argv[i + 1];
+        len = strlen(arg);
+        best = NULL;
+        for (j = 0; j + 3 <= len; j++) {
+            if ((g = hgramfind(arg + j, 0)) == NULL)
+                return;
+            if (best == NULL || g->n < best->n)
+                best = g;
+        }
+        for (j = 0; j < (best ? best->n : nhents); j++) {
+            n = best ? best->ents[j] : j;
+            text = hlogtext(n);
+            if (memmem(text, strlen(text), arg, len) != NULL)
+                hlogprint(n, verb);
+        }
+    } else {
+        printf("%s: usage: history [-v] [n | -p prefix | -s substring]\n",
+               argv[0]);
+    }
 }
 
 /* 
@@ -373,14 +1265,24 @@ void waitfg(pid_t pid)
     // if neither, return
     
     
+    sigset_t mask, prev, waitmask;
+    
     if (getjobpid(jobs,pid) == NULL) {
       return;
     }
 
     // Waits while there's a foreground job, and its status is FG.
+    // SIGCHLD is blocked between the check and sigsuspend, so a child
+    // that ends in between can't be missed and leave us asleep.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    waitmask = prev;
+    sigdelset(&waitmask, SIGCHLD);
     while ((getjobpid(jobs,pid) != NULL)&&(getjobpid(jobs,pid)->state == FG)) {
-      sleep(2);
+      sigsuspend(&waitmask);
     }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
@@ -401,24 +1303,38 @@ void sigchld_handler(int sig)
     mask = (WNOHANG|WUNTRACED);
     int status;
     pid_t pid;
+    struct job_t *job;
+    long long t0 = metrics ? nsnow() : 0;
+    traceev(EV_SIGCHLD, 0, 0);
     // Check separately for stopped and terminated jobs
     // Check for terminated children without waiting for them to terminate
     // printf("entered handler\n");
     while((pid = waitpid(-1,&status,mask)) > 0) {
+      traceev(EV_REAP, pid, status);
+      // Remember how the foreground job ended, for whoever waited on it.
+      if (pid == fgpid(jobs)) {
+        fgstatus = status;
+      }
 
       if(WIFEXITED(status)){
         //Regular terminated process. We just need to delete it from the job
         //list.
         deletejob(jobs,pid);
       }else if(WIFSTOPPED(status)){
-        // Child stopped by sigstop. Update status in job list.
-        
-        getjobpid(jobs,pid)->state = ST;
+        // Child stopped by sigstop. Update status in job list, if
+        // it made it there (addjob may have turned it away).
+        if ((job = getjobpid(jobs,pid)) != NULL)
+          setjobstate(job, ST);
+        continue;
       }else if(WIFSIGNALED(status)){
         //WIFSIGNALED=terminated process.
         // Delete from joblist as well.
         deletejob(jobs,pid);
       }
+      if (metrics) {
+        __atomic_fetch_add(&metrics->reaped, 1, __ATOMIC_RELAXED);
+        histadd(metrics->exitreap, nsnow() - t0);
+      }
 
     }
 
@@ -434,16 +1350,22 @@ void sigchld_handler(int sig)
 void sigint_handler(int sig)
 {
     pid_t pid;
+    int jid;
     pid= fgpid(jobs);
     
-    // We don't need to wory about jobs in the background.
+    // We don't need to wory about jobs in the background, but a
+    // builtin that is waiting (wait) should stop.
     if (pid==0) {
+      interrupted = 1;
       return;
     }else{
     
       // DEATH TO FOREGROUND JOBS
-      kill(pid*-1,sig);
-      printf("Job [%d] (%d) terminated by signal %d\n",pid2jid(pid),pid,sig);
+      // Look the job up first: once it is dead, SIGCHLD can delete it
+      // before we get to print.
+      jid = pid2jid(pid);
+      jobkill(pid,sig);
+      printf("Job [%d] (%d) terminated by signal %d\n",jid,pid,sig);
       
     }
  
@@ -457,16 +1379,18 @@ void sigint_handler(int sig)
 void sigtstp_handler(int sig) 
 {   
     pid_t pid;
+    struct job_t *job;
     pid= fgpid(jobs);
 
     // Again, background jobs are not affected by sigstp here.
-    if (pid==0) {     
+    if (pid==0 || (job = getjobpid(jobs,pid)) == NULL) {     
       return;
     }else{      
     
       // Stops foreground jobs.
-      kill(pid*-1,sig);
-      getjobpid(jobs,pid)->state = ST; 
+      jobkill(pid,sig);
+      setjobstate(job, ST);
+      fgstatus = W_STOPCODE(sig);
       printf("Job [%d] (%d) stopped by signal %d\n",pid2jid(pid),pid,sig);
       return;
     }
@@ -496,84 +1420,140 @@ void initjobs(struct job_t *jobs) {
 
     for (i = 0; i < MAXJOBS; i++)
 	clearjob(&jobs[i]);
+    memset(jidslot, 0, sizeof(jidslot));
+    memset(pidslot, 0, sizeof(pidslot));
+    memset(slotused, 0, sizeof(slotused));
+    njobnames = 0;
+    curjid = prevjid = fgslot = topjid = 0;
 }
 
 /* maxjid - Returns largest allocated job ID */
 int maxjid(struct job_t *jobs) 
 {
-    int i, max=0;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    return topjid;
 }
 
 /* addjob - Add a job to the job list */
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
 {
-    int i;
+    int i, w, h, lo, hi, mid;
     
     if (pid < 1)
 	return 0;
     //printf("call to addjob\n");
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, 
-                    jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-	}
+    // Take the lowest free slot, as a scan of the table would.
+    for (w = 0; w < MAXJOBS / 64 && slotused[w] == ~(uint64_t)0; w++)
+	;
+    if (w == MAXJOBS / 64) {
+	printf("Tried to create too many jobs\n");
+	return 0;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    i = w * 64 + __builtin_ctzll(~slotused[w]);
+
+    jobsbegin();
+    // A slot is free, so some JID is too
+    while (jidslot[nextjid])
+	nextjid = nextjid % MAXJOBS + 1;
+    jobs[i].pid = pid;
+    jobs[i].state = state;
+    jobs[i].jid = nextjid++;
+    if (nextjid > MAXJOBS)
+	nextjid = 1;
+    jobs[i].start = nsnow();
+    strcpy(jobs[i].cmdline, cmdline);
+    slotused[w] |= (uint64_t)1 << (i % 64);
+    jidslot[jobs[i].jid] = i + 1;
+    if (jobs[i].jid > topjid)
+	topjid = jobs[i].jid;
+    for (h = pidhash(pid); pidslot[h] != 0; h = (h + 1) % PIDHASH)
+	;
+    pidslot[h] = i + 1;
+    for (lo = 0, hi = njobnames; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (jobnamecmp(jobnames[mid], i) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    memmove(&jobnames[lo + 1], &jobnames[lo],
+	    (njobnames - lo) * sizeof(int));
+    jobnames[lo] = i;
+    njobnames++;
+    jobcurrent(jobs[i].jid);
+    // Last, so that fgpid never names a job getjobpid can't find yet.
+    if (state == FG)
+	fgslot = i + 1;
+    jobsend();
+    traceev(EV_STATE, pid, state);
+    if (metrics)
+	__atomic_fetch_add(&metrics->started, 1, __ATOMIC_RELAXED);
+    if(verbose){
+	printf("Added job [%d] %d %s\n", jobs[i].jid, 
+	       jobs[i].pid, jobs[i].cmdline);
+    }
+    return 1;
 }
 
 /* deletejob - Delete a job whose PID=pid from the job list */
 int deletejob(struct job_t *jobs, pid_t pid) 
 {
-    int i;
+    int i, jid, lo, hi, mid;
 
-    if (pid < 1)
+    if (pid < 1 || (i = pidfind(pid)) < 0)
 	return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
+    jobsbegin();
+    for (lo = 0, hi = njobnames - 1; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (jobnamecmp(jobnames[mid], i) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
-    return 0;
+    memmove(&jobnames[lo], &jobnames[lo + 1],
+	    (njobnames - lo - 1) * sizeof(int));
+    njobnames--;
+    jid = jobs[i].jid;
+    jidslot[jid] = 0;
+    piddelete(i);
+    slotused[i / 64] &= ~((uint64_t)1 << (i % 64));
+    if (fgslot == i + 1)
+	fgslot = 0;
+    clearjob(&jobs[i]);
+    while (topjid > 0 && jidslot[topjid] == 0)
+	topjid--;
+    // The previous job becomes current; the newest job left
+    // stands in for whichever of them is missing.
+    if (jid == curjid) {
+	curjid = prevjid;
+	prevjid = 0;
+    } else if (jid == prevjid) {
+	prevjid = 0;
+    }
+    for (jid = topjid; jid > 0 && (curjid == 0 || prevjid == 0); jid--)
+	if (jidslot[jid] && jid != curjid) {
+	    if (curjid == 0)
+		curjid = jid;
+	    else
+		prevjid = jid;
+	}
+    jobsend();
+    nextjid = topjid % MAXJOBS + 1;
+    return 1;
 }
 
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    return fgslot ? jobs[fgslot - 1].pid : 0;
 }
 
 /* getjobpid  - Find a job (by PID) on the job list */
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
     int i;
 
-    if (pid < 1)
+    if (pid < 1 || (i = pidfind(pid)) < 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    return &jobs[i];
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
@@ -581,12 +1561,9 @@ struct job_t *getjobjid(struct job_t *jobs, int jid)
 {
     int i;
 
-    if (jid < 1)
+    if (jid < 1 || jid > MAXJOBS || (i = jidslot[jid]) == 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-           return &jobs[i];
-    return NULL;
+    return &jobs[i - 1];
 }
 
 /* pid2jid - Map process ID to job ID */
@@ -594,13 +1571,49 @@ int pid2jid(pid_t pid)
 {
     int i;
 
-    if (pid < 1)
+    if (pid < 1 || (i = pidfind(pid)) < 0)
 	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+    return jobs[i].jid;
+}
+
+/* pidhash - Where pid's search starts in pidslot */
+unsigned pidhash(pid_t pid)
+{
+    return ((unsigned)pid * 2654435761u) % PIDHASH;
+}
+
+/* pidfind - Return the slot of the job with this PID, or -1 */
+int pidfind(pid_t pid)
+{
+    int h;
+
+    for (h = pidhash(pid); pidslot[h] != 0; h = (h + 1) % PIDHASH)
+	if (jobs[pidslot[h] - 1].pid == pid)
+	    return pidslot[h] - 1;
+    return -1;
+}
+
+/*
+ * piddelete - Take slot out of the PID index. The entries after it
+ *    in its run are moved back, so no search stops short at the hole.
+ */
+void piddelete(int slot)
+{
+    int h, i, j;
+
+    for (i = pidhash(jobs[slot].pid); pidslot[i] != slot + 1;
+	 i = (i + 1) % PIDHASH)
+	;
+    for (j = (i + 1) % PIDHASH; pidslot[j] != 0; j = (j + 1) % PIDHASH) {
+	// An entry can fill the hole unless its search starts after
+	// the hole, i.e. cyclically in (i, j].
+	h = pidhash(jobs[pidslot[j] - 1].pid);
+	if (i <= j ? (h <= i || h > j) : (h <= i && h > j)) {
+	    pidslot[i] = pidslot[j];
+	    i = j;
+	}
+    }
+    pidslot[i] = 0;
 }
 
 /* listjobs - Print the job list */
@@ -629,11 +1642,2546 @@ void listjobs(struct job_t *jobs)
 	}
     }
 }
+/*
+ * jobsbegin, jobsend - Bracket a change to the job list so the metrics
+ *    thread can tell when its copy is torn. Signal handlers can change
+ *    the list in the middle of a change by the main loop, so only the
+ *    outermost pair moves the sequence number.
+ */
+void jobsbegin(void)
+{
+    if (jobsdepth++ == 0) {
+        __atomic_store_n(&jobseq, jobseq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+void jobsend(void)
+{
+    if (--jobsdepth == 0)
+        __atomic_store_n(&jobseq, jobseq + 1, __ATOMIC_RELEASE);
+}
+
+/* setjobstate - Change the state of a job */
+void setjobstate(struct job_t *job, int state)
+{
+    jobsbegin();
+    job->state = state;
+    if (state == FG)
+        fgslot = job - jobs + 1;
+    else if (fgslot == job - jobs + 1)
+        fgslot = 0;
+    if (state == ST)
+        jobcurrent(job->jid);
+    jobsend();
+    traceev(EV_STATE, job->pid, state);
+}
+
+/* jobkill - Send sig to the process group of job pid */
+void jobkill(pid_t pid, int sig)
+{
+    kill(-pid, sig);
+    traceev(EV_SIGNAL, pid, sig);
+    if (metrics)
+        __atomic_fetch_add(&metrics->signalled, 1, __ATOMIC_RELAXED);
+}
+/* jobnamecmp - Order job slots by command line, then slot */
+int jobnamecmp(int a, int b)
+{
+    int c = strcmp(jobs[a].cmdline, jobs[b].cmdline);
+
+    return c != 0 ? c : (a > b) - (a < b);
+}
+
+/*
+ * jobnamefind - Position in jobnames of the first job whose command
+ *    line is not less than prefix. The jobs starting with prefix
+ *    follow it.
+ */
+int jobnamefind(const char *prefix)
+{
+    int lo = 0, hi = njobnames, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strcmp(jobs[jobnames[mid]].cmdline, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * jobcurrent - Make jid the current job (%+), and the old current job
+ *    the previous one (%-). Jobs become current when they are started
+ *    or stopped.
+ */
+void jobcurrent(int jid)
+{
+    if (jid != curjid) {
+        prevjid = curjid;
+        curjid = jid;
+    }
+}
+
 /******************************
  * end job list helper routines
  ******************************/
 
 
+/*****************************************
+ * Argument vectors and wildcard expansion
+ *****************************************/
+
+/*
+ * quotemask - Set quoted[i] to WORD_QUOTED if word i of cmdline was
+ *    single quoted, else 0. parseline strips the quotes, so this repeats
+ *    its word splitting on a private copy of the line.
+ */
+void quotemask(const char *cmdline, char *quoted)
+{
+    char buf[MAXLINE];
+    char *p, *delim;
+    int argc = 0, q;
+
+    strncpy(buf, cmdline, MAXLINE - 1);
+    buf[MAXLINE - 1] = '\0';
+    if (buf[0] == '\0')
+        return;
+    buf[strlen(buf) - 1] = ' ';  /* same as parseline */
+
+    p = buf;
+    while (*p == ' ')
+        p++;
+    while (argc < MAXARGS - 1) {
+        if ((q = (*p == '\'')))
+            delim = strchr(++p, '\'');
+        else
+            delim = strchr(p, ' ');
+        if (delim == NULL)
+            break;
+        quoted[argc++] = q ? WORD_QUOTED : 0;
+        p = delim + 1;
+        while (*p == ' ')
+            p++;
+    }
+}
+
+/* argvpush - Append an argument to a growable argument vector */
+void argvpush(struct argvec_t *av, char *arg, int quoted)
+{
+    if (av->argc + 1 >= av->cap) {
+        av->cap = av->cap ? 2 * av->cap : MAXARGS;
+        av->argv = realloc(av->argv, av->cap * sizeof(char *));
+        av->quoted = realloc(av->quoted, av->cap);
+        if (av->argv == NULL || av->quoted == NULL)
+            unix_error("realloc error");
+    }
+    av->quoted[av->argc] = quoted;
+    av->argv[av->argc++] = arg;
+    av->argv[av->argc] = NULL;
+}
+
+/* argvclear - Empty an argument vector, keeping its storage */
+void argvclear(struct argvec_t *av)
+{
+    av->argc = 0;
+    if (av->argv != NULL)
+        av->argv[0] = NULL;
+}
+
+/*
+ * strsave - Copy len bytes of s into the per-line string arena. The
+ *    arena is a list of chunks that are never moved, so the copies stay
+ *    valid until globreset.
+ */
+char *strsave(const char *s, size_t len)
+{
+    struct chunk_t *next;
+    char *p;
+
+    if (len >= CHUNKSIZE)
+        app_error("strsave: string too long");
+    if (curchunk == NULL || curchunk->used + len + 1 > CHUNKSIZE) {
+        next = (curchunk != NULL) ? curchunk->next : chunks;
+        if (next == NULL) {
+            if ((next = malloc(sizeof(struct chunk_t))) == NULL)
+                unix_error("malloc error");
+            next->next = NULL;
+            if (curchunk != NULL)
+                curchunk->next = next;
+            else
+                chunks = next;
+        }
+        next->used = 0;
+        curchunk = next;
+    }
+    p = curchunk->data + curchunk->used;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    curchunk->used += len + 1;
+    return p;
+}
+
+/*
+ * patcompile - Compile one path component containing *, ? or [...]
+ *    into a list of match operations. Returns -1 if the component is
+ *    too long or has too many sets to compile.
+ */
+int patcompile(const char *s, struct pat_t *pat)
+{
+    const char *p, *close;
+    unsigned char *set;
+    int n = 0, neg, c, hi;
+
+    pat->nsets = 0;
+    while (*s) {
+        if (n > NAME_MAX)
+            return -1;
+        switch (*s) {
+        case '*':
+            if (n == 0 || pat->ops[n-1].op != PAT_STAR)
+                pat->ops[n++].op = PAT_STAR;
+            s++;
+            continue;
+        case '?':
+            pat->ops[n++].op = PAT_ANY;
+            s++;
+            continue;
+        case '[':
+            p = s + 1;
+            neg = (*p == '!' || *p == '^');
+            if (neg)
+                p++;
+            close = (*p == ']') ? p + 1 : p;
+            while (*close && *close != ']')
+                close++;
+            if (*close == '\0')
+                break;          /* no closing ]: a literal [ */
+            if (pat->nsets == MAXGLOBSETS)
+                return -1;
+            set = pat->sets[pat->nsets];
+            memset(set, 0, 32);
+            for (; p < close; p++) {
+                c = (unsigned char)p[0];
+                hi = c;
+                if (p[1] == '-' && p + 2 < close) {
+                    hi = (unsigned char)p[2];
+                    p += 2;
+                }
+                for (; c <= hi; c++)
+                    set[c >> 3] |= 1 << (c & 7);
+            }
+            if (neg)
+                for (c = 0; c < 32; c++)
+                    set[c] = ~set[c];
+            pat->ops[n].op = PAT_SET;
+            pat->ops[n++].arg = pat->nsets++;
+            s = close + 1;
+            continue;
+        }
+        pat->ops[n].op = PAT_CHAR;
+        pat->ops[n++].arg = *s++;
+    }
+    pat->ops[n].op = PAT_END;
+    return 0;
+}
+
+/*
+ * patmatch - Match a file name against a compiled pattern. Only the
+ *    most recent * is ever backtracked to, so this is linear in the
+ *    common cases and never recurses.
+ */
+int patmatch(const struct pat_t *pat, const char *s)
+{
+    const struct patop_t *op = pat->ops, *star = NULL;
+    const char *retry = NULL;
+    unsigned char c;
+
+    while ((c = *s) != '\0') {
+        switch (op->op) {
+        case PAT_STAR:
+            star = ++op;
+            retry = s;
+            continue;
+        case PAT_ANY:
+            op++;
+            s++;
+            continue;
+        case PAT_CHAR:
+            if (op->arg == c) {
+                op++;
+                s++;
+                continue;
+            }
+            break;
+        case PAT_SET:
+            if (pat->sets[op->arg][c >> 3] & (1 << (c & 7))) {
+                op++;
+                s++;
+                continue;
+            }
+            break;
+        }
+        if (star == NULL)
+            return 0;
+        op = star;
+        s = ++retry;
+    }
+    while (op->op == PAT_STAR)
+        op++;
+    return op->op == PAT_END;
+}
+
+/*
+ * dirlist - Return the listing of directory path ("" for the current
+ *    directory), or NULL if it can't be read. Listings are read with
+ *    getdents64 in GLOBBUFSIZE batches and cached until globreset,
+ *    keyed by inode and mtime, so a directory named by several
+ *    patterns on one command line is only read once.
+ */
+struct dircache_t *dirlist(const char *path)
+{
+    struct dircache_t *dc;
+    struct dirent64_t *d;
+    struct stat sb;
+    size_t nl;
+    long n, off;
+    int fd, i;
+
+    if ((fd = open(*path ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return NULL;
+    }
+    for (i = 0; i < ndircache; i++) {
+        dc = &dircache[i];
+        if (dc->ino == sb.st_ino && dc->dev == sb.st_dev &&
+            dc->mtime.tv_sec == sb.st_mtim.tv_sec &&
+            dc->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+            close(fd);
+            return dc;
+        }
+    }
+
+    /* Take a free slot, or evict one that no caller is walking */
+    if (ndircache < MAXDIRCACHE) {
+        dc = &dircache[ndircache++];
+    } else {
+        do {
+            dc = &dircache[nextdircache];
+            nextdircache = (nextdircache + 1) % MAXDIRCACHE;
+        } while (dc->busy);
+    }
+    dc->ino = 0;
+    dc->len = 0;
+
+    while ((n = syscall(SYS_getdents64, fd, globbuf, sizeof(globbuf))) > 0) {
+        for (off = 0; off < n; off += d->d_reclen) {
+            d = (struct dirent64_t *)((char *)globbuf + off);
+            nl = strlen(d->d_name);
+            if (nl > NAME_MAX)
+                continue;
+            if (dc->len + nl + 3 > dc->cap) {
+                dc->cap = dc->cap ? 2 * dc->cap : GLOBBUFSIZE;
+                if ((dc->names = realloc(dc->names, dc->cap)) == NULL)
+                    unix_error("realloc error");
+            }
+            dc->names[dc->len] = d->d_type;
+            dc->names[dc->len + 1] = nl;
+            memcpy(dc->names + dc->len + 2, d->d_name, nl + 1);
+            dc->len += nl + 3;
+        }
+    }
+    close(fd);
+    if (n < 0)
+        return NULL;     /* dc->ino stays 0, so it never hits */
+
+    dc->dev = sb.st_dev;
+    dc->ino = sb.st_ino;
+    dc->mtime = sb.st_mtim;
+    return dc;
+}
+
+/*
+ * globwalk - Append to out every existing path that extends path[0..plen)
+ *    by components comp[i..n-1]. pats[i] is the compiled pattern of a
+ *    wildcard component, or NULL for a literal one. Literal components
+ *    aren't listed, so mustexist asks for the final path to be checked.
+ */
+void globwalk(char *path, size_t plen, char **comp, struct pat_t **pats,
+              int i, int n, int mustexist, struct argvec_t *out)
+{
+    struct dircache_t *dc;
+    struct stat sb;
+    char *p, *name;
+    size_t nl;
+    int type;
+
+    path[plen] = '\0';
+    if (i == n) {
+        if (!mustexist || lstat(path, &sb) == 0)
+            argvpush(out, strsave(path, plen), 1);
+        return;
+    }
+
+    if (plen > 0 && path[plen-1] != '/')
+        path[plen++] = '/';
+    if (pats[i] == NULL) {
+        nl = strlen(comp[i]);
+        if (plen + nl >= PATH_MAX)
+            return;
+        memcpy(path + plen, comp[i], nl);
+        globwalk(path, plen + nl, comp, pats, i + 1, n, 1, out);
+        return;
+    }
+
+    path[plen] = '\0';
+    if ((dc = dirlist(path)) == NULL)
+        return;
+    dc->busy++;
+    for (p = dc->names; p < dc->names + dc->len; p = name + nl + 1) {
+        type = (unsigned char)p[0];
+        nl = (unsigned char)p[1];
+        name = p + 2;
+
+        /* A leading . must be matched explicitly; . and .. never are */
+        if (name[0] == '.' && (comp[i][0] != '.' || name[1] == '\0' ||
+                               (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if (i < n - 1 && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+            continue;
+        if (plen + nl >= PATH_MAX || !patmatch(pats[i], name))
+            continue;
+        memcpy(path + plen, name, nl);
+        globwalk(path, plen + nl, comp, pats, i + 1, n, 0, out);
+    }
+    dc->busy--;
+}
+
+/* argcmp - qsort comparison for sorting expanded words */
+int argcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * globword - Append the sorted expansion of one wildcard word to out.
+ *    A word that matches nothing is passed through unchanged, as in sh.
+ */
+void globword(char *word, struct argvec_t *out)
+{
+    char buf[PATH_MAX], path[PATH_MAX];
+    char *comp[MAXGLOBDEPTH];
+    struct pat_t *pats[MAXGLOBDEPTH];
+    size_t len = strlen(word);
+    int n = 0, i, start = out->argc;
+    char *p;
+
+    if (len >= PATH_MAX) {
+        argvpush(out, word, 0);
+        return;
+    }
+    memcpy(buf, word, len + 1);
+
+    /* Split the word into path components */
+    for (p = buf; *p; ) {
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+        if (n == MAXGLOBDEPTH) {
+            argvpush(out, word, 0);
+            return;
+        }
+        comp[n++] = p;
+        while (*p && *p != '/')
+            p++;
+        if (*p)
+            *p++ = '\0';
+    }
+    if (len > 1 && word[len-1] == '/' && n < MAXGLOBDEPTH)
+        comp[n++] = "";          /* trailing / only matches directories */
+
+    for (i = 0; i < n; i++) {
+        pats[i] = NULL;
+        if (strpbrk(comp[i], "*?[") && patcompile(comp[i], &globpats[i]) == 0)
+            pats[i] = &globpats[i];
+    }
+
+    path[0] = '/';
+    globwalk(path, word[0] == '/', comp, pats, 0, n, 0, out);
+
+    if (out->argc == start)
+        argvpush(out, word, 0);
+    else
+        qsort(out->argv + start, out->argc - start, sizeof(char *), argcmp);
+}
+
+/*
+ * globargv - Expand the unquoted words of av that contain *, ? or [.
+ *    Returns av itself when there is nothing to expand, otherwise the
+ *    expanded vector (valid until the next call).
+ */
+struct argvec_t *globargv(struct argvec_t *av)
+{
+    int i;
+
+    for (i = 0; i < av->argc; i++)
+        if (!(av->quoted[i] & WORD_NOGLOB) && strpbrk(av->argv[i], "*?["))
+            break;
+    if (i == av->argc)
+        return av;
+
+    argvclear(&globargs);
+    for (i = 0; i < av->argc; i++) {
+        if (!(av->quoted[i] & WORD_NOGLOB) && strpbrk(av->argv[i], "*?["))
+            globword(av->argv[i], &globargs);
+        else
+            argvpush(&globargs, av->argv[i], av->quoted[i]);
+    }
+    return &globargs;
+}
+
+/*
+ * globreset - Forget the directory listings and strings of the last
+ *    command line. Their memory is kept for the next one.
+ */
+void globreset(void)
+{
+    ndircache = 0;
+    nextdircache = 0;
+    curchunk = NULL;
+}
+
+/****************
+ * I/O redirection
+ ****************/
+
+/* isbuiltin - Return true if name is one of the builtin commands */
+int isbuiltin(char *name)
+{
+    char **b;
+
+    for (b = builtins; *b != NULL; b++)
+        if (!strcmp(name, *b))
+            return 1;
+    return 0;
+}
+
+/*
+ * parseredir - Remove the redirections (<, >, >>, N>, N>&M, N>&-, with
+ *    the file either attached or in the next word) from the unquoted
+ *    words of av and describe them in redirs. Returns the number of
+ *    redirections, or -1 with a message in sbuf if one is malformed.
+ */
+int parseredir(struct argvec_t *av, struct redir_t *redirs)
+{
+    struct redir_t *r;
+    char *p, *end;
+    int i, j, n = 0;
+
+    for (i = j = 0; i < av->argc; i++) {
+        p = av->argv[i];
+        while (isdigit((unsigned char)*p))
+            p++;
+        if ((av->quoted[i] & WORD_NOREDIR) || (*p != '<' && *p != '>')) {
+            av->quoted[j] = av->quoted[i];
+            av->argv[j++] = av->argv[i];
+            continue;
+        }
+        if (n == MAXREDIRS) {
+            sprintf(sbuf, "Too many redirections\n");
+            return -1;
+        }
+
+        r = &redirs[n++];
+        r->fd = (p > av->argv[i]) ? atoi(av->argv[i]) : (*p == '>');
+        r->path = NULL;
+        if (*p == '<') {
+            r->flags = O_RDONLY;
+            p++;
+        } else if (p[1] == '>') {
+            r->flags = O_WRONLY|O_CREAT|O_APPEND;
+            p += 2;
+        } else {
+            r->flags = O_WRONLY|O_CREAT|O_TRUNC;
+            p++;
+        }
+
+        if (*p == '&') {
+            /* Duplicate (N>&M) or close (N>&-) a descriptor */
+            r->flags = -1;
+            r->dupfd = (p[1] == '-' && p[2] == '\0') ? -1 : strtol(p + 1, &end, 10);
+            if (r->dupfd >= 0 && (end == p + 1 || *end != '\0')) {
+                snprintf(sbuf, MAXLINE, "%s: bad file descriptor\n", av->argv[i]);
+                return -1;
+            }
+        } else if (*p != '\0') {
+            r->path = p;
+        } else if (i + 1 < av->argc) {
+            r->path = av->argv[++i];
+        } else {
+            snprintf(sbuf, MAXLINE, "%s: missing file name\n", av->argv[i]);
+            return -1;
+        }
+    }
+    av->argc = j;
+    av->argv[j] = NULL;
+    return n;
+}
+
+/*
+ * applyredirs - Perform the redirections in order. Returns -1 after
+ *    printing a message if a file can't be opened or moved into place.
+ */
+int applyredirs(struct redir_t *redirs, int nredir)
+{
+    struct redir_t *r;
+    int i, fd;
+
+    for (i = 0; i < nredir; i++) {
+        r = &redirs[i];
+        if (r->flags == -1) {
+            if (r->dupfd < 0) {
+                close(r->fd);
+            } else if (dup2(r->dupfd, r->fd) < 0) {
+                fprintf(stderr, "%d: %s\n", r->dupfd, strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        if ((fd = open(r->path, r->flags, 0666)) < 0) {
+            fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+            return -1;
+        }
+        if (fd != r->fd) {
+            if (dup2(fd, r->fd) < 0) {
+                fprintf(stderr, "%s: %s\n", r->path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*
+ * redirsave - Apply redirections to the shell itself, first saving a
+ *    copy of each descriptor they replace in saved[] so that
+ *    redirrestore can put them back. Used for builtins, which don't
+ *    fork. Returns -1 (with everything restored) on failure.
+ */
+int redirsave(struct redir_t *redirs, int nredir, int *saved)
+{
+    int i;
+
+    if (nredir == 0)
+        return 0;
+    fflush(stdout);
+    for (i = 0; i < nredir; i++)
+        saved[i] = fcntl(redirs[i].fd, F_DUPFD_CLOEXEC, 10);
+    if (applyredirs(redirs, nredir) < 0) {
+        redirrestore(redirs, nredir, saved);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * redirrestore - Undo redirsave. Descriptors are restored last to
+ *    first, so one that was redirected twice ends up as it started.
+ */
+void redirrestore(struct redir_t *redirs, int nredir, int *saved)
+{
+    int i;
+
+    if (nredir == 0)
+        return;
+    fflush(stdout);
+    for (i = nredir - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], redirs[i].fd);
+            close(saved[i]);
+        } else {
+            close(redirs[i].fd);   /* wasn't open before */
+        }
+    }
+}
+
+/*
+ * fastcopy - Run "cat < in > out" (or >> out) without forking, by
+ *    copying in to out with copy_file_range, falling back to sendfile
+ *    and then to read/write when the kernel can't copy between the two
+ *    files directly. Returns 0 if the command isn't of that form, or
+ *    if in and out are the same file, which cat itself refuses.
+ */
+int fastcopy(char **argv, struct redir_t *redirs, int nredir)
+{
+    struct redir_t *in, *out;
+    struct stat sb, osb;
+    char buf[MAXLINE * 8];
+    ssize_t n;
+    int infd, outfd;
+
+    if (nredir != 2 || argv[1] != NULL ||
+        (strcmp(argv[0], "/bin/cat") && strcmp(argv[0], "/usr/bin/cat")))
+        return 0;
+    in = (redirs[0].fd == 0) ? &redirs[0] : &redirs[1];
+    out = (in == &redirs[0]) ? &redirs[1] : &redirs[0];
+    if (in->fd != 0 || in->flags != O_RDONLY || out->fd != 1 || out->flags == -1)
+        return 0;
+    if (stat(in->path, &sb) < 0 || !S_ISREG(sb.st_mode))
+        return 0;       /* let cat report the error, or read the pipe */
+    // Appending a file to itself would never reach the end of it.
+    if (stat(out->path, &osb) == 0 &&
+        osb.st_dev == sb.st_dev && osb.st_ino == sb.st_ino)
+        return 0;
+
+    if ((infd = open(in->path, O_RDONLY|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s: %s\n", in->path, strerror(errno));
+        laststatus = 1;
+        return 1;
+    }
+    if ((outfd = open(out->path, out->flags|O_CLOEXEC, 0666)) < 0) {
+        fprintf(stderr, "%s: %s\n", out->path, strerror(errno));
+        close(infd);
+        laststatus = 1;
+        return 1;
+    }
+
+    while ((n = syscall(SYS_copy_file_range, infd, NULL, outfd, NULL,
+                        COPYCHUNK, 0)) > 0)
+        ;
+    if (n < 0)
+        while ((n = sendfile(outfd, infd, NULL, COPYCHUNK)) > 0)
+            ;
+    if (n < 0) {
+        while ((n = read(infd, buf, sizeof(buf))) > 0)
+            if (write(outfd, buf, n) != n) {
+                n = -1;
+                break;
+            }
+    }
+    if (n < 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        laststatus = 1;
+    }
+
+    close(infd);
+    close(outfd);
+    return 1;
+}
+
+/**********************
+ * Command substitution
+ **********************/
+
+/*
+ * substline - Run each $(...) in cmdline, look up each $name, ${name}
+ *    and $?, and copy cmdline to line with every substitution replaced
+ *    by SUBSTMARK and its index. A variable's value is kept in substbuf
+ *    like command output, so it is only split into words and is never
+ *    parsed as part of the line. Returns the number of substitutions
+ *    (0 leaves line untouched), or -1 if one is malformed, its command
+ *    was stopped, or a signal killed it.
+ */
+int substline(const char *cmdline, char *line)
+{
+    char text[MAXLINE];
+    const char *p, *close, *val;
+    char *q = line;
+    int n = 0, depth, wordstart = 1, ref;
+
+    if (strchr(cmdline, '$') == NULL)
+        return 0;
+
+    substlen = 0;
+    for (p = cmdline; *p; ) {
+        /* A word that starts with ' is quoted up to the next ' */
+        if (wordstart && *p == '\'' && (close = strchr(p + 1, '\'')) != NULL) {
+            memcpy(q, p, close + 1 - p);
+            q += close + 1 - p;
+            p = close + 1;
+            wordstart = 0;
+            continue;
+        }
+        if (p[0] != '$') {
+            wordstart = (*p == ' ');
+            *q++ = *p++;
+            continue;
+        }
+        if (p[1] != '(') {
+            if ((ref = varref(&p, &val)) < 0)
+                return -1;
+            if (ref == 0) {
+                *q++ = *p++;
+                wordstart = 0;
+                continue;
+            }
+            if (n == MAXSUBST) {
+                fprintf(stderr, "Too many substitutions\n");
+                return -1;
+            }
+            substs[n].off = substlen;
+            for (; val != NULL && *val; val++) {
+                substgrow();
+                substbuf[substlen++] = *val;
+            }
+            substs[n].len = substlen - substs[n].off;
+            substgrow();
+            substbuf[substlen++] = '\0';
+            *q++ = SUBSTMARK;
+            *q++ = 'A' + n++;
+            wordstart = 0;
+            continue;
+        }
+
+        for (close = p + 2, depth = 1; *close; close++) {
+            if (*close == '(')
+                depth++;
+            else if (*close == ')' && --depth == 0)
+                break;
+        }
+        if (*close == '\0') {
+            fprintf(stderr, "Missing ) in command substitution\n");
+            return -1;
+        }
+        if (n == MAXSUBST) {
+            fprintf(stderr, "Too many substitutions\n");
+            return -1;
+        }
+        memcpy(text, p + 2, close - p - 2);
+        text[close - p - 2] = '\0';
+        if (strstr(text, "$(") != NULL) {
+            fprintf(stderr, "Nested command substitution is not supported\n");
+            return -1;
+        }
+
+        substs[n].off = substlen;
+        if (runsubst(text) < 0)
+            return -1;
+        substs[n].len = substlen - substs[n].off;
+        substgrow();
+        substbuf[substlen++] = '\0';    /* ends the last word */
+        *q++ = SUBSTMARK;
+        *q++ = 'A' + n++;
+        p = close + 1;
+        wordstart = 0;
+    }
+    *q = '\0';
+    return n;
+}
+
+/* substgrow - Make sure substbuf has room for at least one more byte */
+void substgrow(void)
+{
+    if (substlen < substcap)
+        return;
+    substcap = substcap ? 2 * substcap : SUBSTBUFSIZE;
+    if ((substbuf = realloc(substbuf, substcap)) == NULL)
+        unix_error("realloc error");
+}
+
+/*
+ * runsubst - Run one substituted command and append its output to
+ *    substbuf. An external command is an ordinary foreground job that
+ *    writes into a pipe, so ctrl-c and ctrl-z reach it as usual. A
+ *    builtin writes into a memfd instead, since it runs in the shell
+ *    and would block forever on a full pipe. Variables in its words are
+ *    expanded after they have been split, and a word with one is never
+ *    taken as a redirection. Returns -1 if the command was stopped or
+ *    killed by a signal, or a variable is malformed.
+ */
+int runsubst(char *text)
+{
+    char buf[MAXLINE], word[MAXLINE];
+    char *words[MAXARGS];
+    char quoted[MAXARGS];
+    struct argvec_t args;
+    struct redir_t redirs[MAXREDIRS + 1];
+    struct job_t *job;
+    struct pollfd pfd;
+    sigset_t mask, waitmask;
+    int i, nredir, fds[2], stopped = 0;
+    ssize_t n;
+    pid_t pid = 0;
+
+    snprintf(buf, sizeof(buf), "%s\n", text);
+    parseline(buf, words);
+    if (words[0] == NULL)
+        return 0;
+    quotemask(buf, quoted);
+    args.argv = words;
+    args.quoted = quoted;
+    for (args.argc = 0; words[args.argc] != NULL; args.argc++)
+        ;
+    args.cap = MAXARGS;
+    for (i = 0; i < args.argc; i++) {
+        if (quoted[i] || strchr(words[i], '$') == NULL)
+            continue;
+        if (varexpand(words[i], word) < 0)
+            return -1;
+        words[i] = strsave(word, strlen(word));
+        quoted[i] = WORD_NOREDIR;
+    }
+
+    /* Our stdout redirection goes first; the command's own ones follow */
+    if ((nredir = parseredir(&args, redirs + 1)) < 0) {
+        fprintf(stderr, "%s", sbuf);
+        return -1;
+    }
+    if (args.argc == 0)
+        return 0;
+    redirs[0].fd = 1;
+    redirs[0].flags = -1;
+    redirs[0].path = NULL;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (isbuiltin(words[0])) {
+        if ((fds[0] = syscall(SYS_memfd_create, "tsh-subst", MFD_CLOEXEC)) < 0)
+            unix_error("memfd_create error");
+        redirs[0].dupfd = fds[0];
+        builtin_cmd(globargv(&args)->argv, redirs, nredir + 1);
+        lseek(fds[0], 0, SEEK_SET);
+    } else {
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            unix_error("pipe error");
+        redirs[0].dupfd = fds[1];
+        fgstatus = 0;
+        pid = launch(globargv(&args)->argv, redirs, nredir + 1, FG, buf);
+        close(fds[1]);
+
+        /* The signals stay blocked outside ppoll so a stop can't slip by */
+        sigprocmask(SIG_BLOCK, NULL, &waitmask);
+        sigdelset(&waitmask, SIGCHLD);
+        sigdelset(&waitmask, SIGINT);
+        sigdelset(&waitmask, SIGTSTP);
+    }
+
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    for (;;) {
+        if (pid != 0) {
+            if ((job = getjobpid(jobs, pid)) != NULL && job->state == ST) {
+                stopped = 1;
+                break;
+            }
+            if (ppoll(&pfd, 1, NULL, &waitmask) < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+        }
+        substgrow();
+        if ((n = read(fds[0], substbuf + substlen, substcap - substlen)) <= 0)
+            break;
+        substlen += n;
+    }
+    close(fds[0]);
+    if (pid == 0)
+        return 0;
+
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    if (stopped)
+        return -1;
+    waitfg(pid);
+    return WIFSIGNALED(fgstatus) ? -1 : 0;
+}
+
+/*
+ * substargv - Replace the substitution marks in the words of av with
+ *    the commands' output, split into words at blanks and newlines.
+ *    The output is split in place in substbuf, so a word that is just a
+ *    substitution becomes argv entries without being copied. Text glued
+ *    to a substitution joins its first or last word. Output is never
+ *    taken as a redirection; only glued words are still expanded as
+ *    wildcards.
+ */
+struct argvec_t *substargv(struct argvec_t *av, int nsubst)
+{
+    char *p, *w, *f, *start, *end;
+    size_t len, flen;
+    int i, k, nf, glued;
+
+    /* Split each substitution's output into NUL-separated words */
+    for (k = 0; k < nsubst; k++) {
+        end = substbuf + substs[k].off + substs[k].len;
+        for (p = substbuf + substs[k].off; p < end; p++)
+            if (*p == ' ' || *p == '\t' || *p == '\n')
+                *p = '\0';
+    }
+
+    argvclear(&substargs);
+    for (i = 0; i < av->argc; i++) {
+        w = av->argv[i];
+        if (av->quoted[i] || strchr(w, SUBSTMARK) == NULL) {
+            argvpush(&substargs, w, av->quoted[i]);
+            continue;
+        }
+
+        /* A word that is just a substitution becomes its output words */
+        if (w[0] == SUBSTMARK && w[2] == '\0') {
+            k = w[1] - 'A';
+            end = substbuf + substs[k].off + substs[k].len;
+            for (f = substbuf + substs[k].off; f < end; f += strlen(f) + 1)
+                if (*f != '\0')
+                    argvpush(&substargs, f, WORD_QUOTED);
+            continue;
+        }
+
+        /* Otherwise build the glued words in substword */
+        len = 0;
+        glued = 0;
+        for (; *w; w++) {
+            if (*w != SUBSTMARK) {
+                if (len < sizeof(substword) - 1)
+                    substword[len++] = *w;
+                glued = 1;
+                continue;
+            }
+            k = *++w - 'A';
+            start = substbuf + substs[k].off;
+            end = start + substs[k].len;
+            for (f = start, nf = 0; f < end; f += flen + 1) {
+                if ((flen = strlen(f)) == 0)
+                    continue;
+                if (nf++ > 0) {
+                    argvpush(&substargs, strsave(substword, len),
+                             WORD_NOREDIR);
+                    len = 0;
+                }
+                if (len + flen >= sizeof(substword))
+                    flen = sizeof(substword) - 1 - len;
+                memcpy(substword + len, f, flen);
+                len += flen;
+                glued = 1;
+            }
+        }
+        if (glued)
+            argvpush(&substargs, strsave(substword, len), WORD_NOREDIR);
+    }
+    return &substargs;
+}
+
+/******************
+ * Compiled scripts
+ ******************/
+
+/* bufput - Append n bytes to a growable buffer; returns their offset */
+size_t bufput(struct buf_t *b, const void *p, size_t n)
+{
+    size_t off = b->len;
+
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap)
+            b->cap = b->cap ? 2 * b->cap : CHUNKSIZE;
+        if ((b->data = realloc(b->data, b->cap)) == NULL)
+            unix_error("realloc error");
+    }
+    memcpy(b->data + off, p, n);
+    b->len += n;
+    return off;
+}
+
+/*
+ * tshcompile - Pre-parse every line of a script into command records
+ *    (appended to cmds) whose words, redirections and original lines
+ *    are offsets into strs. Lines that need work at run time, such as
+ *    substitutions and variables, and lines that control flow parses
+ *    (keywords and ;), are kept as TSHC_RAW records for eval. Returns
+ *    the number of records, or -1, with a message naming the script,
+ *    if a line is too long to run whole.
+ */
+int tshcompile(const char *name, const char *text, size_t size,
+               struct buf_t *cmds, struct buf_t *strs)
+{
+    char buf[MAXLINE];
+    char *words[MAXARGS];
+    char quoted[MAXARGS];
+    struct argvec_t args;
+    struct redir_t redirs[MAXREDIRS];
+    struct tshc_cmd_t c;
+    struct tshc_redir_t r;
+    const char *p, *nl, *end = text + size;
+    size_t len;
+    uint32_t off;
+    int i, bg, nredir, ncmds = 0, lineno = 0;
+
+    for (p = text; p < end; p = nl ? nl + 1 : end) {
+        nl = memchr(p, '\n', end - p);
+        len = (nl ? nl : end) - p;
+        lineno++;
+        if (len > MAXLINE - 2) {
+            fprintf(stderr, "%s: line %d: line too long\n", name, lineno);
+            return -1;
+        }
+        memcpy(buf, p, len);
+        buf[len] = '\n';
+        buf[len + 1] = '\0';
+
+        memset(&c, 0, sizeof(c));
+        if (strpbrk(buf, "$;") != NULL ||
+            cfkeyword(buf + strspn(buf, " \t")) != CF_NONE) {
+            c.flags = TSHC_RAW;
+        } else {
+            bg = parseline(buf, words);
+            if (words[0] == NULL)
+                continue;
+            quotemask(buf, quoted);
+            args.argv = words;
+            args.quoted = quoted;
+            for (args.argc = 0; words[args.argc] != NULL; args.argc++)
+                ;
+            args.cap = MAXARGS;
+            if ((nredir = parseredir(&args, redirs)) < 0) {
+                c.flags = TSHC_RAW;     /* eval reports the error */
+            } else {
+                c.flags = bg ? TSHC_BG : 0;
+                c.argc = args.argc;
+                c.nredir = nredir;
+            }
+        }
+
+        c.line = bufput(strs, buf, len + 2);
+        bufput(cmds, &c, sizeof(c));
+        for (i = 0; i < c.argc; i++) {
+            off = bufput(strs, args.argv[i], strlen(args.argv[i]) + 1);
+            if (args.quoted[i])
+                off |= TSHC_QUOTED;
+            bufput(cmds, &off, sizeof(off));
+        }
+        for (i = 0; i < c.nredir; i++) {
+            r.fd = redirs[i].fd;
+            r.flags = redirs[i].flags;
+            r.dupfd = redirs[i].dupfd;
+            r.path = 0;
+            if (redirs[i].path != NULL)
+                r.path = bufput(strs, redirs[i].path, strlen(redirs[i].path) + 1);
+            bufput(cmds, &r, sizeof(r));
+        }
+        ncmds++;
+    }
+    return ncmds;
+}
+
+/*
+ * tshcrun - Run compiled command records. Their words and redirections
+ *    point straight into strs, which may be a read-only mapping of the
+ *    cache file.
+ */
+void tshcrun(const char *cmds, uint32_t ncmds, const char *strs)
+{
+    const struct tshc_cmd_t *c;
+    const struct tshc_redir_t *r;
+    const uint32_t *offs;
+    char line[MAXLINE];
+    char *words[MAXARGS];
+    char quoted[MAXARGS];
+    struct argvec_t args;
+    struct redir_t redirs[MAXREDIRS];
+    uint32_t n;
+    int i;
+
+    for (n = 0; n < ncmds; n++) {
+        c = (const struct tshc_cmd_t *)cmds;
+        offs = (const uint32_t *)(c + 1);
+        r = (const struct tshc_redir_t *)(offs + c->argc);
+        cmds = (const char *)(r + c->nredir);
+
+        traceev(EV_LINE, 0, 0);
+        if ((c->flags & TSHC_RAW) || cfdepth > 0) {
+            // Inside a for, while or if, every line goes to cfline.
+            strcpy(line, strs + c->line);
+            if (!cfline(line))
+                eval(line);
+        } else {
+            for (i = 0; i < c->argc; i++) {
+                words[i] = (char *)strs + (offs[i] & ~TSHC_QUOTED);
+                quoted[i] = (offs[i] & TSHC_QUOTED) ? WORD_QUOTED : 0;
+            }
+            words[i] = NULL;
+            args.argv = words;
+            args.quoted = quoted;
+            args.argc = c->argc;
+            args.cap = MAXARGS;
+            for (i = 0; i < c->nredir; i++) {
+                redirs[i].fd = r[i].fd;
+                redirs[i].flags = r[i].flags;
+                redirs[i].dupfd = r[i].dupfd;
+                redirs[i].path = (char *)strs + r[i].path;
+            }
+            evalargs((char *)strs + c->line, &args, c->flags & TSHC_BG,
+                     redirs, c->nredir);
+        }
+        globreset();
+        fflush(stdout);
+    }
+    if (cfdepth > 0) {
+        printf("syntax error: unexpected end of file\n");
+        cfreset();
+    }
+}
+
+/*
+ * tshccheck - Check that ncmds command records fill exactly cmdlen
+ *    bytes, that no record has more words or redirections than
+ *    tshcrun has room for, and that every string offset points at a
+ *    NUL-terminated string inside strs whose line fits in MAXLINE.
+ *    Returns -1 if the cache is damaged, so it is compiled again.
+ */
+int tshccheck(const char *cmds, uint32_t ncmds, uint32_t cmdlen,
+              const char *strs, uint32_t strslen)
+{
+    const struct tshc_cmd_t *c;
+    const struct tshc_redir_t *r;
+    const uint32_t *offs;
+    const char *p = cmds, *end = cmds + cmdlen;
+    uint32_t n;
+    int i;
+
+    if (strslen == 0 || strs[strslen - 1] != '\0')
+        return -1;
+    for (n = 0; n < ncmds; n++) {
+        c = (const struct tshc_cmd_t *)p;
+        if (end - p < sizeof(*c) || c->argc >= MAXARGS ||
+            c->nredir > MAXREDIRS ||
+            end - p < sizeof(*c) + c->argc * sizeof(uint32_t) +
+                      c->nredir * sizeof(*r))
+            return -1;
+        offs = (const uint32_t *)(c + 1);
+        r = (const struct tshc_redir_t *)(offs + c->argc);
+        p = (const char *)(r + c->nredir);
+        if (c->line >= strslen || strnlen(strs + c->line, MAXLINE) == MAXLINE)
+            return -1;
+        for (i = 0; i < c->argc; i++)
+            if ((offs[i] & ~TSHC_QUOTED) >= strslen)
+                return -1;
+        for (i = 0; i < c->nredir; i++)
+            if (r[i].path >= strslen)
+                return -1;
+    }
+    return p == end ? 0 : -1;
+}
+
+/*
+ * tshcmap - Map the cache file and return it if it was compiled by
+ *    this version of tsh from the script at path with sb's size and
+ *    mtime. Returns NULL if it is missing, stale or damaged.
+ */
+char *tshcmap(const char *cache, const char *path, struct stat *sb,
+              size_t *len)
+{
+    struct tshc_hdr_t *hdr;
+    struct stat cb;
+    char *map, *cmds;
+    size_t pathlen = strlen(path);
+    int fd;
+
+    if ((fd = open(cache, O_RDONLY|O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &cb) < 0 || cb.st_size < sizeof(struct tshc_hdr_t)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, cb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    hdr = (struct tshc_hdr_t *)map;
+    if (hdr->magic != TSHC_MAGIC || hdr->version != TSHC_VERSION ||
+        hdr->size != sb->st_size || hdr->mtime_sec != sb->st_mtim.tv_sec ||
+        hdr->mtime_nsec != sb->st_mtim.tv_nsec || hdr->pathlen != pathlen ||
+        memcmp(map + sizeof(*hdr), path, pathlen) != 0 ||
+        sizeof(*hdr) + ((pathlen + 7) & ~7) + hdr->cmdlen + hdr->strlen !=
+        cb.st_size) {
+        munmap(map, cb.st_size);
+        return NULL;
+    }
+    cmds = map + sizeof(*hdr) + ((pathlen + 7) & ~7);
+    if (tshccheck(cmds, hdr->ncmds, hdr->cmdlen, cmds + hdr->cmdlen,
+                  hdr->strlen) < 0) {
+        munmap(map, cb.st_size);
+        return NULL;
+    }
+    *len = cb.st_size;
+    return map;
+}
+
+/*
+ * tshcwrite - Save a compiled script to its cache file. The file is
+ *    written under a temporary name and renamed into place, so other
+ *    shells never map a partly written cache. Failure is not an error;
+ *    the script is just parsed again next time.
+ */
+void tshcwrite(const char *cache, const char *path, struct stat *sb,
+               int ncmds, struct buf_t *cmds, struct buf_t *strs)
+{
+    struct tshc_hdr_t hdr;
+    struct buf_t out = { NULL, 0, 0 };
+    char tmp[PATH_MAX + 16];
+    static const char pad[8];
+    size_t pathlen = strlen(path);
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TSHC_MAGIC;
+    hdr.version = TSHC_VERSION;
+    hdr.size = sb->st_size;
+    hdr.mtime_sec = sb->st_mtim.tv_sec;
+    hdr.mtime_nsec = sb->st_mtim.tv_nsec;
+    hdr.pathlen = pathlen;
+    hdr.ncmds = ncmds;
+    hdr.cmdlen = cmds->len;
+    hdr.strlen = strs->len;
+    bufput(&out, &hdr, sizeof(hdr));
+    bufput(&out, path, pathlen);
+    bufput(&out, pad, ((pathlen + 7) & ~7) - pathlen);
+    bufput(&out, cmds->data, cmds->len);
+    bufput(&out, strs->data, strs->len);
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+    if ((fd = mkstemp(tmp)) >= 0) {
+        if (write(fd, out.data, out.len) != out.len || rename(tmp, cache) < 0)
+            unlink(tmp);
+        close(fd);
+    }
+    free(out.data);
+}
+
+/*
+ * runscript - Run the commands in a script file. The script is compiled
+ *    into a pre-parsed form that is cached in a .<name>.tshc file next
+ *    to it, keyed by the script's path, size and mtime; later runs map
+ *    the cache and skip parseline entirely.
+ */
+void runscript(char *script)
+{
+    char path[PATH_MAX], cache[PATH_MAX + 8];
+    struct buf_t cmds = { NULL, 0, 0 }, strs = { NULL, 0, 0 };
+    struct tshc_hdr_t *hdr;
+    struct stat sb;
+    char *text, *map, *slash;
+    size_t len;
+    int fd, ncmds;
+
+    if (realpath(script, path) == NULL || (fd = open(path, O_RDONLY)) < 0 ||
+        fstat(fd, &sb) < 0)
+        unix_error(script);
+    slash = strrchr(path, '/');
+    snprintf(cache, sizeof(cache), "%.*s.%s.tshc", (int)(slash + 1 - path),
+             path, slash + 1);
+
+    if ((map = tshcmap(cache, path, &sb, &len)) != NULL) {
+        close(fd);
+        hdr = (struct tshc_hdr_t *)map;
+        text = map + sizeof(*hdr) + ((hdr->pathlen + 7) & ~7);
+        tshcrun(text, hdr->ncmds, text + hdr->cmdlen);
+        munmap(map, len);
+        return;
+    }
+
+    if ((text = malloc(sb.st_size + 1)) == NULL)
+        unix_error("malloc error");
+    if (read(fd, text, sb.st_size) != sb.st_size)
+        unix_error(script);
+    close(fd);
+    ncmds = tshcompile(script, text, sb.st_size, &cmds, &strs);
+    free(text);
+    if (ncmds < 0)
+        exit(1);
+    tshcwrite(cache, path, &sb, ncmds, &cmds, &strs);
+    tshcrun(cmds.data, ncmds, strs.data);
+    free(cmds.data);
+    free(strs.data);
+}
+
+/******************
+ * Metrics endpoint
+ ******************/
+
+/* nsnow - CLOCK_MONOTONIC in nanoseconds (async-signal-safe) */
+long long nsnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* histadd - Count a latency in its log2 microsecond bucket */
+void histadd(unsigned long *hist, long long ns)
+{
+    long long us = ns / 1000;
+    int b = 0;
+
+    while (us > 0 && b < HISTBUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    __atomic_fetch_add(&hist[b], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * metricsinit - Start serving metrics on the unix socket at path. The
+ *    counters go in a shared mapping so that children can record their
+ *    own fork-to-exec time. A thread with every signal blocked answers
+ *    connections, so neither the command loop nor the handlers ever
+ *    wait on a client.
+ */
+void metricsinit(char *path)
+{
+    struct sockaddr_un addr;
+    pthread_t tid;
+    sigset_t all, prev;
+
+    metrics = mmap(NULL, sizeof(struct metrics_t), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED)
+        unix_error("mmap error");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_error("metrics socket path too long");
+    strcpy(addr.sun_path, path);
+    if ((metricsfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    // Replace a socket left behind by a shell that died, but not a live
+    // one, and nothing that isn't a socket.
+    if (bind(metricsfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+        (errno != EADDRINUSE || !metricsstale(&addr) || unlink(path) < 0 ||
+         bind(metricsfd, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+        unix_error(path);
+    metricssock = path;
+    metricspid = getpid();
+    atexit(metricsexit);
+    chmod(path, 0600);
+    if (listen(metricsfd, 8) < 0)
+        unix_error("listen error");
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    if (pthread_create(&tid, NULL, metricsloop, NULL) != 0)
+        app_error("pthread_create error");
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * metricsstale - True if addr is a socket that nobody is listening on,
+ *    so it was left behind by a shell that didn't exit cleanly.
+ */
+int metricsstale(struct sockaddr_un *addr)
+{
+    struct stat sb;
+    int fd, stale;
+
+    if (lstat(addr->sun_path, &sb) < 0 || !S_ISSOCK(sb.st_mode))
+        return 0;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+        return 0;
+    stale = connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+            errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/* metricsexit - Remove our socket when the shell exits (not a child) */
+void metricsexit(void)
+{
+    if (getpid() == metricspid)
+        unlink(metricssock);
+}
+
+/*
+ * metricsloop - The metrics thread: answer one connection at a time.
+ *    If accept keeps failing for lack of descriptors or memory, back
+ *    off instead of spinning; if the socket itself is bad, give up.
+ */
+void *metricsloop(void *arg)
+{
+    struct timeval tv = { 1, 0 };
+    struct timespec backoff = { 0, 100000000 };
+    int fd;
+
+    for (;;) {
+        if ((fd = accept4(metricsfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK)
+                return NULL;
+            if (errno != EINTR && errno != ECONNABORTED)
+                nanosleep(&backoff, NULL);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        metricsserve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * jobsnapshot - Copy the live jobs into snap without locking, retrying
+ *    while the main thread is changing the list. Returns the number of
+ *    jobs copied, or -1 if no consistent copy could be made.
+ */
+int jobsnapshot(struct job_t *snap)
+{
+    unsigned seq;
+    int i, n, tries;
+
+    for (tries = 0; tries < SEQRETRIES; tries++) {
+        seq = __atomic_load_n(&jobseq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        for (i = n = 0; i < MAXJOBS; i++)
+            if (jobs[i].pid != 0)
+                snap[n++] = jobs[i];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&jobseq, __ATOMIC_RELAXED) == seq)
+            return n;
+    }
+    return -1;
+}
+
+/*
+ * metricsserve - Write a plain text snapshot to fd: one "job" line per
+ *    job (jid, pid, state, start time, CPU seconds, command line), then
+ *    the counters, then the non-empty histogram buckets as
+ *    <upper bound in us>:<count>.
+ */
+void metricsserve(int fd)
+{
+    static char *states[] = { "Undefined", "Foreground", "Running", "Stopped" };
+    static const char *hnames[] = { "fork_exec_us", "exit_reap_us" };
+    char buf[MAXLINE + 256], stat[MAXLINE], *p;
+    struct job_t *job;
+    struct timespec rt;
+    unsigned long *hist, utime, stime;
+    long long now, start;
+    double cpu;
+    int i, b, n, len, statfd;
+
+    n = jobsnapshot(metricjobs);
+    clock_gettime(CLOCK_REALTIME, &rt);
+    now = nsnow();
+
+    len = snprintf(buf, sizeof(buf), "jobs %d\n", n);
+    write(fd, buf, len);
+    for (i = 0; i < n; i++) {
+        job = &metricjobs[i];
+
+        /* utime and stime are fields 14 and 15 of /proc/<pid>/stat */
+        cpu = 0;
+        snprintf(stat, sizeof(stat), "/proc/%d/stat", job->pid);
+        if ((statfd = open(stat, O_RDONLY|O_CLOEXEC)) >= 0) {
+            len = read(statfd, stat, sizeof(stat) - 1);
+            close(statfd);
+            stat[len > 0 ? len : 0] = '\0';
+            if ((p = strrchr(stat, ')')) != NULL &&
+                sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                       &utime, &stime) == 2)
+                cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+
+        start = rt.tv_sec * 1000000LL + rt.tv_nsec / 1000 - (now - job->start) / 1000;
+        len = snprintf(buf, sizeof(buf), "job %d %d %s %lld.%06lld %.2f %s",
+                       job->jid, job->pid, states[job->state & 3],
+                       start / 1000000, start % 1000000, cpu, job->cmdline);
+        if (len > 0 && buf[len - 1] != '\n' && len < sizeof(buf) - 1)
+            buf[len++] = '\n';
+        write(fd, buf, len);
+    }
+
+    len = snprintf(buf, sizeof(buf), "started %lu\nreaped %lu\nsignalled %lu\n",
+                   metrics->started, metrics->reaped, metrics->signalled);
+    write(fd, buf, len);
+    for (i = 0; i < 2; i++) {
+        hist = i ? metrics->exitreap : metrics->forkexec;
+        len = snprintf(buf, sizeof(buf), "%s", hnames[i]);
+        for (b = 0; b < HISTBUCKETS; b++)
+            if (hist[b] != 0)
+                len += snprintf(buf + len, sizeof(buf) - len, " %lu:%lu",
+                                1UL << b, hist[b]);
+        buf[len++] = '\n';
+        write(fd, buf, len);
+    }
+}
+
+/***************
+ * Event tracing
+ ***************/
+
+/*
+ * traceinit - Map the event ring. It is shared so that children can
+ *    record their own fork and exec events into it.
+ */
+void traceinit(void)
+{
+    if (tracering != NULL)
+        return;
+    tracering = mmap(NULL, sizeof(struct tracering_t), PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (tracering == MAP_FAILED)
+        unix_error("mmap error");
+}
+
+/*
+ * traceev - Record an event. Lock-free and async-signal-safe: a slot is
+ *    claimed with one atomic add, and its seq is only set to the slot's
+ *    index + 1 once the record is complete, so readers skip records
+ *    that are half written or already overwritten.
+ */
+void traceev(int type, pid_t pid, int arg)
+{
+    struct trace_event_t *ev;
+    unsigned long idx;
+
+    if (!tracing)
+        return;
+    idx = __atomic_fetch_add(&tracering->head, 1, __ATOMIC_RELAXED);
+    ev = &tracering->ev[idx & (TRACE_RING - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->ns = nsnow();
+    ev->type = type;
+    ev->pid = pid;
+    ev->arg = arg;
+    __atomic_store_n(&ev->seq, (uint32_t)(idx + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * tracedump - Write the complete events in the ring since it was last
+ *    cleared to file (stdout if NULL) as a trace_hdr_t followed by the
+ *    events, oldest first.
+ *    tshtrace decodes the result.
+ */
+void tracedump(char *file)
+{
+    struct trace_event_t *ev;
+    struct trace_hdr_t hdr;
+    unsigned long head, tail, idx;
+    uint32_t seq;
+    int fd = 1;
+
+    if (tracering == NULL) {
+        printf("trace: nothing recorded\n");
+        return;
+    }
+    if (file != NULL &&
+        (fd = open(file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0) {
+        printf("%s: %s\n", file, strerror(errno));
+        return;
+    }
+
+    tail = __atomic_load_n(&tracering->tail, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&tracering->head, __ATOMIC_ACQUIRE);
+    hdr.magic = TRACE_MAGIC;
+    hdr.count = 0;
+    for (idx = head - tail > TRACE_RING ? head - TRACE_RING : tail;
+         idx < head; idx++) {
+        ev = &tracering->ev[idx & (TRACE_RING - 1)];
+        seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+        tracecopy[hdr.count] = *ev;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq == (uint32_t)(idx + 1) &&
+            __atomic_load_n(&ev->seq, __ATOMIC_RELAXED) == seq)
+            hdr.count++;
+    }
+    hdr.dropped = head - tail - hdr.count;
+
+    fflush(stdout);
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(fd, tracecopy, hdr.count * sizeof(struct trace_event_t)) !=
+        hdr.count * sizeof(struct trace_event_t))
+        printf("trace dump: %s\n", strerror(errno));
+    if (fd != 1)
+        close(fd);
+}
+
+/*****************
+ * Command history
+ *****************/
+
+/*
+ * hloginit - Open and map the history log, $TSH_HISTFILE or else
+ *    ~/.tsh_history, creating it if needed. The log is shared by every
+ *    tsh using the same file; setting TSH_HISTFILE to "" turns it off.
+ */
+void hloginit(void)
+{
+    char path[PATH_MAX], *file = getenv("TSH_HISTFILE"), *home;
+    struct hlog_hdr_t hdr, *h;
+    struct stat sb;
+    int fd;
+
+    if (file == NULL) {
+        if ((home = getenv("HOME")) == NULL)
+            return;
+        snprintf(path, sizeof(path), "%s/.tsh_history", home);
+        file = path;
+    }
+    if (*file == '\0')
+        return;
+    if ((fd = open(file, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0) {
+        printf("%s: %s\n", file, strerror(errno));
+        return;
+    }
+
+    // Whoever gets the lock first on a new file lays out the header.
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &sb) == 0 && sb.st_size == 0 &&
+        posix_fallocate(fd, 0, HLOG_INITSIZE) == 0) {
+        hdr.magic = HLOG_MAGIC;
+        hdr.version = HLOG_VERSION;
+        hdr.tail = sizeof(hdr);
+        hdr.size = HLOG_INITSIZE;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            sb.st_size = 0;
+        else
+            fstat(fd, &sb);
+    }
+    flock(fd, LOCK_UN);
+
+    if (sb.st_size < (off_t)sizeof(hdr) ||
+        (h = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                  fd, 0)) == MAP_FAILED) {
+        printf("%s: can't map history log\n", file);
+        close(fd);
+        return;
+    }
+    if (h->magic != HLOG_MAGIC || h->version != HLOG_VERSION) {
+        printf("%s: not a tsh history log\n", file);
+        munmap(h, sb.st_size);
+        close(fd);
+        return;
+    }
+    hlog = (char *)h;
+    hlogmap = sb.st_size;
+    hlogfd = fd;
+    hlogscanned = sizeof(hdr);
+}
+
+/*
+ * hlogroom - Make sure the log is mapped at least up to offset end,
+ *    growing the file (for every shell sharing it) if it's too small.
+ *    Growing is the only thing that takes the file lock. Returns -1,
+ *    with a message, if there is no room.
+ */
+int hlogroom(uint64_t end)
+{
+    struct hlog_hdr_t *hdr = (struct hlog_hdr_t *)hlog;
+    uint64_t size;
+    char *p;
+    int err = 0;
+
+    if (end <= hlogmap)
+        return 0;
+    if ((size = __atomic_load_n(&hdr->size, __ATOMIC_ACQUIRE)) < end) {
+        flock(hlogfd, LOCK_EX);
+        size = __atomic_load_n(&hdr->size, __ATOMIC_ACQUIRE);
+        if (size < end) {
+            while (size < end)
+                size *= 2;
+            // Allocate the blocks now, so a full disk is an error here
+            // rather than a SIGBUS when the mapping is written.
+            if ((err = posix_fallocate(hlogfd, 0, size)) == 0)
+                __atomic_store_n(&hdr->size, size, __ATOMIC_RELEASE);
+        }
+        flock(hlogfd, LOCK_UN);
+        if (err != 0) {
+            printf("history: %s\n", strerror(err));
+            return -1;
+        }
+    }
+    if ((p = mremap(hlog, hlogmap, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+        printf("history: %s\n", strerror(errno));
+        return -1;
+    }
+    hlog = p;
+    hlogmap = size;
+    return 0;
+}
+
+/* hlogrecsize - Bytes taken by a record whose len is len */
+uint64_t hlogrecsize(uint32_t len)
+{
+    return (sizeof(struct hlog_rec_t) + len + 7) & ~(uint64_t)7;
+}
+
+/*
+ * hlogappend - Log a command line (up to its newline) as running, and
+ *    return the offset of its record, or 0 if it wasn't logged. There
+ *    is no lock and no fsync: the slot at the tail is claimed by
+ *    setting its length and our pid from 0 with one compare-and-swap,
+ *    so any shell can move the tail past the slot as soon as it is
+ *    taken, and can tell if we die before it is written. The record
+ *    counts once done is set.
+ */
+uint64_t hlogappend(const char *line)
+{
+    struct hlog_hdr_t *hdr;
+    struct hlog_rec_t *rec;
+    uint64_t off, next, claimed;
+    uint32_t len;
+    size_t n = strcspn(line, "\n");
+
+    if (hlog == NULL || line[strspn(line, " \t\n")] == '\0')
+        return 0;
+    len = n + 1;
+    for (;;) {
+        off = __atomic_load_n(&((struct hlog_hdr_t *)hlog)->tail,
+                              __ATOMIC_ACQUIRE);
+        if (hlogroom(off + hlogrecsize(len)) < 0)
+            return 0;
+        hdr = (struct hlog_hdr_t *)hlog;
+        rec = (struct hlog_rec_t *)(hlog + off);
+        claimed = 0;
+        if (__atomic_compare_exchange_n(&rec->claim, &claimed,
+                                        (uint64_t)getpid() << 32 | len, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+        // Another shell has the slot; help it move the tail on.
+        next = off;
+        __atomic_compare_exchange_n(&hdr->tail, &next,
+                                    off + hlogrecsize((uint32_t)claimed), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    next = off;
+    __atomic_compare_exchange_n(&hdr->tail, &next, off + hlogrecsize(len), 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+    rec->status = HLOG_RUNNING;
+    rec->time = time(NULL);
+    memcpy(rec->text, line, n);
+    rec->text[n] = '\0';
+    __atomic_store_n(&rec->done, HLOG_DONE, __ATOMIC_RELEASE);
+    return off;
+}
+
+/* hlogdone - Record the exit status of the line logged at off */
+void hlogdone(uint64_t off, int status)
+{
+    if (hlog == NULL || off == 0)
+        return;
+    __atomic_store_n(&((struct hlog_rec_t *)(hlog + off))->status, status,
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * hlogindex - Add the records logged since the last call (by any
+ *    shell) to hents and the sorted index. Stops at a record that is
+ *    still being written, unless the shell writing it has died.
+ */
+void hlogindex(void)
+{
+    struct hlog_rec_t *rec;
+    uint64_t tail, claim;
+    int old = nhents, i, lo, hi, mid;
+
+    tail = __atomic_load_n(&((struct hlog_hdr_t *)hlog)->tail,
+                           __ATOMIC_ACQUIRE);
+    if (hlogroom(tail) < 0)
+        return;
+    while (hlogscanned < tail) {
+        rec = (struct hlog_rec_t *)(hlog + hlogscanned);
+        claim = __atomic_load_n(&rec->claim, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->done, __ATOMIC_ACQUIRE) != HLOG_DONE) {
+            if (kill((pid_t)(claim >> 32), 0) == 0 || errno != ESRCH)
+                break;
+        } else {
+            if (nhents == hentcap) {
+                hentcap = hentcap ? 2 * hentcap : 256;
+                if ((hents = realloc(hents, hentcap * sizeof(uint64_t))) ==
+                    NULL ||
+                    (hsorted = realloc(hsorted, hentcap * sizeof(int))) ==
+                    NULL)
+                    unix_error("realloc error");
+            }
+            hents[nhents] = hlogscanned;
+            hsorted[nhents] = nhents;
+            hgramadd(nhents++);
+        }
+        hlogscanned += hlogrecsize((uint32_t)claim);
+    }
+
+    // A few new lines are inserted into the sorted index; a big batch,
+    // like the whole log on the first call, is sorted in one go.
+    if (nhents - old > 16) {
+        qsort(hsorted, nhents, sizeof(int), hentcmp);
+        return;
+    }
+    for (i = old; i < nhents; i++) {
+        for (lo = 0, hi = i; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (hentcmp(&hsorted[mid], &i) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        memmove(&hsorted[lo + 1], &hsorted[lo], (i - lo) * sizeof(int));
+        hsorted[lo] = i;
+    }
+}
+
+/* hlogtext - The text of history entry i */
+char *hlogtext(int i)
+{
+    return ((struct hlog_rec_t *)(hlog + hents[i]))->text;
+}
+
+/* hentcmp - qsort comparison for hsorted: by text, then log order */
+int hentcmp(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    int c = strcmp(hlogtext(x), hlogtext(y));
+
+    return c != 0 ? c : (x > y) - (x < y);
+}
+
+/*
+ * hlogprefix - Position in hsorted of the first entry whose text is
+ *    not less than prefix. The entries starting with prefix follow it.
+ */
+int hlogprefix(const char *prefix)
+{
+    int lo = 0, hi = nhents, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strcmp(hlogtext(hsorted[mid]), prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * hgramfind - The index entry for the trigram at s, or NULL if no
+ *    entry has it. With add, the entry is created if need be, and the
+ *    table doubled once it is half full.
+ */
+struct hgram_t *hgramfind(const char *s, int add)
+{
+    struct hgram_t *old = hgrams, *g;
+    uint32_t gram = ((uint8_t)s[0] << 16 | (uint8_t)s[1] << 8 |
+                     (uint8_t)s[2]) + 1;
+    int i, n = hgramcap;
+
+    if (add && 2 * (nhgrams + 1) > hgramcap) {
+        hgramcap = hgramcap ? 2 * hgramcap : 1024;
+        if ((hgrams = calloc(hgramcap, sizeof(*hgrams))) == NULL)
+            unix_error("calloc error");
+        for (i = 0; i < n; i++) {
+            if (old[i].gram == 0)
+                continue;
+            for (g = &hgrams[(old[i].gram * 2654435761u) & (hgramcap - 1)];
+                 g->gram != 0;
+                 g = (g == &hgrams[hgramcap - 1]) ? hgrams : g + 1)
+                ;
+            *g = old[i];
+        }
+        free(old);
+    }
+    if (hgramcap == 0)
+        return NULL;
+    for (g = &hgrams[(gram * 2654435761u) & (hgramcap - 1)]; g->gram != gram;
+         g = (g == &hgrams[hgramcap - 1]) ? hgrams : g + 1) {
+        if (g->gram == 0) {
+            if (!add)
+                return NULL;
+            g->gram = gram;
+            nhgrams++;
+            break;
+        }
+    }
+    return g;
+}
+
+/* hgramadd - Add history entry i under each trigram of its text */
+void hgramadd(int i)
+{
+    struct hgram_t *g;
+    char *text = hlogtext(i);
+    size_t j, len = strlen(text);
+
+    for (j = 0; j + 3 <= len; j++) {
+        g = hgramfind(text + j, 1);
+        if (g->n > 0 && g->ents[g->n - 1] == i)
+            continue;           /* the trigram came up before in i */
+        if (g->n == g->cap) {
+            g->cap = g->cap ? 2 * g->cap : 4;
+            if ((g->ents = realloc(g->ents, g->cap * sizeof(int))) == NULL)
+                unix_error("realloc error");
+        }
+        g->ents[g->n++] = i;
+    }
+}
+
+/*
+ * hlogexpand - If cmdline starts with !!, !n or !prefix, replace that
+ *    word with the last line logged, line n, or the last line starting
+ *    with prefix, and echo the result. Returns 0, with a message, if
+ *    there is no such line.
+ */
+int hlogexpand(char *cmdline)
+{
+    char line[MAXLINE], *word = cmdline + 1, *end, *num, c;
+    int i = -1, lo;
+    size_t len;
+
+    if (cmdline[0] != '!' || isspace(cmdline[1]) || cmdline[1] == '\0')
+        return 1;
+    end = word + strcspn(word, " \t\n");
+    if (hlog != NULL) {
+        hlogindex();
+        c = *end;
+        *end = '\0';
+        if (!strcmp(word, "!")) {
+            i = nhents - 1;
+        } else if (isdigit(word[0])) {
+            i = strtol(word, &num, 10) - 1;
+            if (*num != '\0' || i >= nhents)
+                i = -1;
+        } else {
+            // The latest of the run of entries starting with word
+            len = strlen(word);
+            for (lo = hlogprefix(word);
+                 lo < nhents && !strncmp(hlogtext(hsorted[lo]), word, len);
+                 lo++)
+                if (hsorted[lo] > i)
+                    i = hsorted[lo];
+        }
+        *end = c;
+    }
+    if (i < 0) {
+        printf("%.*s: event not found\n", (int)(end - cmdline), cmdline);
+        return 0;
+    }
+    if (snprintf(line, MAXLINE, "%s%s", hlogtext(i), end) >= MAXLINE) {
+        printf("%.*s: expanded line too long\n", (int)(end - cmdline),
+               cmdline);
+        return 0;
+    }
+    strcpy(cmdline, line);
+    printf("%s", cmdline);
+    return 1;
+}
+
+/*
+ * hlogprint - Print history entry i, with its start time and exit
+ *    status if verbose
+ */
+void hlogprint(int i, int verbose)
+{
+    struct hlog_rec_t *rec = (struct hlog_rec_t *)(hlog + hents[i]);
+    char when[32], status[16];
+    time_t t = rec->time;
+    int st = __atomic_load_n(&rec->status, __ATOMIC_ACQUIRE);
+
+    if (!verbose) {
+        printf("%5d  %s\n", i + 1, rec->text);
+        return;
+    }
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    if (st == HLOG_RUNNING)
+        strcpy(status, "-");
+    else
+        sprintf(status, "%d", st);
+    printf("%5d  %s  %3s  %s\n", i + 1, when, status, rec->text);
+}
+
+/*
+ * exitcode - The exit status of a command, given its wait status:
+ *    128 + the signal if it was killed or stopped
+ */
+int exitcode(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 0;
+}
+
+/**************
+ * Control flow
+ **************/
+
+/*
+ * varref - If *pp starts a $name, ${name} or $? reference, move *pp
+ *    past it and set *val (NULL if unset) and return 1. Returns 0 if it
+ *    doesn't, or -1, with a message, for an unclosed ${.
+ */
+int varref(const char **pp, const char **val)
+{
+    static char num[16];
+    const char *p = *pp, *name;
+    size_t n;
+    int brace;
+
+    if (p[0] == '$' && p[1] == '?') {
+        sprintf(num, "%d", laststatus);
+        *val = num;
+        *pp = p + 2;
+        return 1;
+    }
+    brace = p[1] == '{';
+    if (p[0] != '$' || !(isalpha(p[1 + brace]) || p[1 + brace] == '_'))
+        return 0;
+    name = p + 1 + brace;
+    for (n = 0; isalnum(name[n]) || name[n] == '_'; n++)
+        ;
+    if (brace && name[n] != '}') {
+        fprintf(stderr, "%.*s: bad substitution\n", (int)(n + 2), p);
+        return -1;
+    }
+    *val = getvar(name, n);
+    *pp = name + n + brace;
+    return 1;
+}
+
+/*
+ * varexpand - Copy the word in to out (MAXLINE bytes) with its
+ *    variable references replaced by their values. Variables set by
+ *    for come first, then the environment; unset ones expand to
+ *    nothing. This is for words that have already been split, so a
+ *    value is never parsed again. Returns -1, with a message, if a
+ *    reference is malformed or the result is too long.
+ */
+int varexpand(const char *in, char *out)
+{
+    const char *p, *val;
+    char *q = out;
+    size_t n;
+    int ref;
+
+    for (p = in; *p; ) {
+        if ((ref = varref(&p, &val)) < 0)
+            return -1;
+        if (ref == 0) {
+            val = p++;
+            n = 1;
+        } else {
+            n = val ? strlen(val) : 0;
+        }
+        if (q + n >= out + MAXLINE) {
+            fprintf(stderr, "Line too long after expansion\n");
+            return -1;
+        }
+        memcpy(q, val, n);
+        q += n;
+    }
+    *q = '\0';
+    return 0;
+}
+
+/* getvar - The value of the variable called name[0..len-1], or NULL */
+char *getvar(const char *name, size_t len)
+{
+    char buf[MAXVARNAME];
+    int i;
+
+    for (i = 0; i < nvars; i++)
+        if (strlen(vars[i].name) == len && !strncmp(vars[i].name, name, len))
+            return vars[i].value;
+    if (len >= MAXVARNAME)
+        return NULL;
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    return getenv(buf);
+}
+
+/* setvar - Set a shell variable, creating it if needed */
+void setvar(const char *name, const char *value)
+{
+    int i;
+
+    for (i = 0; i < nvars && strcmp(vars[i].name, name); i++)
+        ;
+    if (i == MAXVARS) {
+        printf("%s: too many variables\n", name);
+        return;
+    }
+    if (i == nvars)
+        strcpy(vars[nvars++].name, name);
+    snprintf(vars[i].value, MAXLINE, "%s", value);
+}
+
+/*
+ * cfkeyword - The CF_* keyword that command s starts with, or CF_NONE.
+ *    A keyword is a whole word: it ends at a blank, ;, newline or the
+ *    end of s.
+ */
+int cfkeyword(const char *s)
+{
+    size_t n;
+    int k;
+
+    for (k = CF_FOR; cfkeywords[k] != NULL; k++) {
+        n = strlen(cfkeywords[k]);
+        if (!strncmp(s, cfkeywords[k], n) && strchr(" \t;\n", s[n]))
+            return k;
+    }
+    return CF_NONE;
+}
+
+/* cfpush - Add the command s[0..len-1] to the block being read */
+void cfpush(const char *s, size_t len)
+{
+    struct cfnode_t node;
+
+    node.text = bufput(&cftext, s, len);
+    bufput(&cftext, "", 1);
+    node.kw = cfkeyword(cftext.data + node.text);
+    node.link = -1;
+    bufput(&cfnodes, &node, sizeof(node));
+    ncfnodes++;
+    if (node.kw == CF_FOR || node.kw == CF_WHILE || node.kw == CF_IF)
+        cfdepth++;
+    else if (node.kw == CF_DONE || node.kw == CF_FI)
+        cfdepth--;
+}
+
+/*
+ * cfsplit - Add one ;-separated command to the block. Keywords that
+ *    come before a command (while, if, elif, do, then, else) are split
+ *    off as commands of their own, so "while true" is "while", "true".
+ */
+void cfsplit(const char *s, size_t len)
+{
+    size_t n;
+    int kw;
+
+    for (;;) {
+        while (len > 0 && isspace(*s)) {
+            s++;
+            len--;
+        }
+        while (len > 0 && isspace(s[len - 1]))
+            len--;
+        if (len == 0)
+            return;
+        kw = cfkeyword(s);
+        if (kw == CF_NONE || kw == CF_FOR || kw == CF_DONE || kw == CF_FI) {
+            cfpush(s, len);
+            return;
+        }
+        n = strlen(cfkeywords[kw]);
+        cfpush(s, n);
+        s += n;
+        len -= n;
+    }
+}
+
+/*
+ * cfamp - Whether line has an & that ends one command and is followed
+ *    by more. A trailing & is left to eval, and one after < or > is
+ *    part of a redirection.
+ */
+int cfamp(const char *line)
+{
+    const char *p;
+
+    for (p = strchr(line, '&'); p != NULL; p = strchr(p + 1, '&'))
+        if ((p == line || (p[-1] != '<' && p[-1] != '>')) &&
+            p[1 + strspn(p + 1, " \t\n")] != '\0')
+            return 1;
+    return 0;
+}
+
+/*
+ * cfline - Take a line that is, or is part of, a for, while or if, or
+ *    that has several commands separated by ; or &. The commands are added
+ *    to the block being read, and once every for, while and if in it
+ *    is closed the block is run. Returns 0 for a line that is none of
+ *    these, which the caller passes to eval as usual.
+ */
+int cfline(char *line)
+{
+    struct cfnode_t *nodes;
+    const char *p, *start, *close;
+    int depth = 0, wordstart = 1;
+
+    if (cfdepth == 0 && strchr(line, ';') == NULL && !cfamp(line) &&
+        cfkeyword(line + strspn(line, " \t")) == CF_NONE)
+        return 0;
+
+    // Split at the ;, & and newlines that aren't quoted or inside
+    // $(...). An & stays with its command, so eval runs it in the
+    // background; one after < or > is part of a redirection, and one
+    // with no command before it (as in &&) is an error.
+    for (p = start = line; ; p++) {
+        if (wordstart && *p == '\'' && (close = strchr(p + 1, '\'')) != NULL) {
+            p = close;
+            wordstart = 0;
+            continue;
+        }
+        if (depth == 0 && p[0] == '$' && p[1] == '(') {
+            depth = 1;
+            p++;
+        } else if (depth > 0 && *p == '(') {
+            depth++;
+        } else if (depth > 0 && *p == ')') {
+            depth--;
+        } else if (*p == '\0' || (depth == 0 && (*p == ';' || *p == '\n'))) {
+            cfsplit(start, p - start);
+            if (*p == '\0')
+                break;
+            start = p + 1;
+        } else if (depth == 0 && *p == '&' &&
+                   (p == line || (p[-1] != '<' && p[-1] != '>'))) {
+            if (p[1] == '&' || start + strspn(start, " \t\n") == p) {
+                printf("syntax error near '%s'\n", p[1] == '&' ? "&&" : "&");
+                cfreset();
+                return 1;
+            }
+            cfsplit(start, p + 1 - start);
+            start = p + 1;
+        }
+        wordstart = (*p == ' ' || *p == '\t' || *p == ';' || *p == '&');
+    }
+    if (cfdepth > 0)
+        return 1;
+
+    // The block is complete: match up its keywords and run it.
+    nodes = (struct cfnode_t *)cfnodes.data;
+    if (cfdepth == 0 && cflink(nodes) == 0) {
+        fgstatus = 0;
+        interrupted = 0;
+        cfabort = 0;
+        cfexec(nodes, 0, ncfnodes);
+    } else if (cfdepth < 0) {
+        printf("syntax error near '%s'\n", cftext.data + nodes[ncfnodes - 1].text);
+    }
+    cfreset();
+    return 1;
+}
+
+/*
+ * cflink - Check that the keywords of the block nest properly and link
+ *    each for and while to its do and each do to its done, and each if
+ *    or elif to its then and each then to the elif, else or fi after
+ *    it, and each else to its fi. Returns -1, with a message, if they
+ *    don't.
+ */
+int cflink(struct cfnode_t *nodes)
+{
+    int *stack, top = -1, i, kw, open, ok;
+
+    if ((stack = malloc(ncfnodes * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    for (i = 0; i < ncfnodes; i++) {
+        kw = nodes[i].kw;
+        open = top >= 0 ? nodes[stack[top]].kw : CF_NONE;
+        switch (kw) {
+        case CF_FOR:
+        case CF_WHILE:
+        case CF_IF:
+            ok = open != CF_FOR;
+            stack[++top] = i;
+            break;
+        case CF_DO:
+            ok = open == CF_FOR || (open == CF_WHILE && stack[top] < i - 1);
+            break;
+        case CF_THEN:
+            ok = (open == CF_IF || open == CF_ELIF) && stack[top] < i - 1;
+            break;
+        case CF_ELIF:
+        case CF_ELSE:
+        case CF_FI:
+            ok = open == CF_THEN || (kw == CF_FI && open == CF_ELSE);
+            break;
+        case CF_DONE:
+            ok = open == CF_DO;
+            break;
+        default:
+            ok = open != CF_FOR;    /* for's words are followed by do */
+        }
+        if (!ok) {
+            printf("syntax error near '%s'\n", cftext.data + nodes[i].text);
+            free(stack);
+            return -1;
+        }
+        if (kw == CF_NONE || kw == CF_FOR || kw == CF_WHILE || kw == CF_IF)
+            continue;
+        nodes[stack[top]].link = i;
+        if (kw == CF_DONE || kw == CF_FI)
+            top--;
+        else
+            stack[top] = i;
+    }
+    free(stack);
+    return 0;
+}
+
+/*
+ * cfexec - Run commands i up to end of the block. $? is the status of
+ *    the last command run. Stops as soon as cfabort is set.
+ */
+void cfexec(struct cfnode_t *nodes, int i, int end)
+{
+    int j, then, next, status;
+
+    while (i < end && !cfabort) {
+        switch (nodes[i].kw) {
+        case CF_FOR:
+            cffor(nodes, i);
+            i = nodes[nodes[i].link].link + 1;
+            break;
+        case CF_WHILE:
+            // $? is the body's, or 0 if it never ran.
+            j = nodes[i].link;      /* do */
+            for (status = 0; ; ) {
+                cfexec(nodes, i + 1, j);
+                if (cfabort)
+                    status = laststatus;
+                if (cfabort || laststatus != 0)
+                    break;
+                cfexec(nodes, j + 1, nodes[j].link);
+                status = laststatus;
+                if (cfabort)
+                    break;
+            }
+            laststatus = status;
+            i = nodes[j].link + 1;
+            break;
+        case CF_IF:
+            // Try each if or elif condition until one succeeds.
+            for (j = i; ; j = next) {
+                then = nodes[j].link;
+                next = nodes[then].link;
+                cfexec(nodes, j + 1, then);
+                if (cfabort)
+                    break;
+                if (laststatus == 0) {
+                    cfexec(nodes, then + 1, next);
+                    break;
+                }
+                if (nodes[next].kw == CF_ELIF)
+                    continue;
+                if (nodes[next].kw == CF_ELSE)
+                    cfexec(nodes, next + 1, nodes[next].link);
+                else
+                    laststatus = 0;
+                break;
+            }
+            // Skip to the fi
+            for (j = nodes[nodes[i].link].link; nodes[j].kw != CF_FI; ) {
+                if (nodes[j].kw == CF_ELSE)
+                    j = nodes[j].link;
+                else
+                    j = nodes[nodes[j].link].link;
+            }
+            i = j + 1;
+            break;
+        default:
+            cfsimple(cftext.data + nodes[i].text);
+            i++;
+        }
+    }
+}
+
+/*
+ * cffor - Run "for name in words...; do ...; done" starting at node i.
+ *    The words are expanded once, like the words of a command, and
+ *    copied out, since running the body reuses parseline's buffer.
+ */
+void cffor(struct cfnode_t *nodes, int i)
+{
+    char line[MAXLINE], text[MAXLINE], name[MAXVARNAME];
+    char *words[MAXARGS], quoted[MAXARGS];
+    struct argvec_t args, *xargs;
+    struct buf_t list = { NULL, 0, 0 };
+    char *p = cftext.data + nodes[i].text + 3, *w;
+    int do_ = nodes[i].link, nsubst, n;
+
+    p += strspn(p, " \t");
+    n = strcspn(p, " \t");
+    if (n == 0 || n >= MAXVARNAME || !(isalpha(*p) || *p == '_') ||
+        strspn(p, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+               "0123456789_") != n) {
+        printf("for: '%.*s': not a valid name\n", n, p);
+        laststatus = 1;
+        return;
+    }
+    memcpy(name, p, n);
+    name[n] = '\0';
+    p += n;
+    p += strspn(p, " \t");
+    if (strncmp(p, "in", 2) || (p[2] != '\0' && !isspace(p[2]))) {
+        printf("for: expected 'in' after %s\n", name);
+        laststatus = 1;
+        return;
+    }
+
+    // Expand the words as eval would, without running anything.
+    snprintf(text, MAXLINE - 1, "%s\n", p + 2);
+    p = text;
+    if ((nsubst = substline(p, line)) < 0) {
+        laststatus = 1;
+        return;
+    }
+    parseline(nsubst ? line : p, words);
+    quotemask(nsubst ? line : p, quoted);
+    args.argv = words;
+    args.quoted = quoted;
+    for (args.argc = 0; words[args.argc] != NULL; args.argc++)
+        ;
+    args.cap = MAXARGS;
+    xargs = globargv(nsubst ? substargv(&args, nsubst) : &args);
+    for (n = 0; n < xargs->argc; n++)
+        bufput(&list, xargs->argv[n], strlen(xargs->argv[n]) + 1);
+    globreset();
+
+    laststatus = 0;
+    for (w = list.data; w < list.data + list.len && !cfabort;
+         w += strlen(w) + 1) {
+        setvar(name, w);
+        cfexec(nodes, do_ + 1, nodes[do_].link);
+    }
+    free(list.data);
+}
+
+/*
+ * cfsimple - Run one simple command of a block through eval, so that
+ *    builtins run in the shell and other commands become jobs of
+ *    their own. A command killed by ctrl-c or stopped by ctrl-z, or a
+ *    ctrl-c while a builtin runs, stops the whole block.
+ */
+void cfsimple(char *cmd)
+{
+    char line[MAXLINE];
+
+    snprintf(line, MAXLINE, "%s\n", cmd);
+    traceev(EV_LINE, 0, 0);
+    eval(line);
+    globreset();
+    fflush(stdout);
+    if (interrupted || WIFSTOPPED(fgstatus) ||
+        (WIFSIGNALED(fgstatus) && WTERMSIG(fgstatus) == SIGINT))
+        cfabort = 1;
+}
+
+/* cfreset - Throw away the block being read */
+void cfreset(void)
+{
+    cftext.len = 0;
+    cfnodes.len = 0;
+    ncfnodes = 0;
+    cfdepth = 0;
+}
+
 /***********************
  * Other helper routines
  ***********************/
@@ -643,10 +4191,14 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpt] [-m socket] [script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -m   serve job and launch metrics on unix socket\n");
+    printf("   -t   record trace events (see the trace builtin)\n");
+    printf("   script  run the commands in script (cached pre-parsed)\n");
+    printf("   $TSH_HISTFILE  history log (~/.tsh_history; \"\" for none)\n");
     exit(1);
 }
 
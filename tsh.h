@@ -1,11 +1,105 @@
 #ifndef __TSH_H__
 #define __TSH_H__
 
+#include <stdint.h>
+
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
+#define MAXJOBS    4096   /* max jobs at any point in time (a multiple of 64) */
+#define PIDHASH (2*MAXJOBS) /* slots in the PID index (a power of 2) */
+
+/* Word flags (argvec_t.quoted) */
+#define WORD_NOGLOB  0x01 /* not expanded as a wildcard */
+#define WORD_NOREDIR 0x02 /* never taken as a redirection */
+#define WORD_QUOTED  (WORD_NOGLOB|WORD_NOREDIR) /* single quoted */
+
+/* I/O redirection */
+#define MAXREDIRS      16   /* max redirections on a command line */
+#define COPYCHUNK  (1<<30)  /* bytes per copy_file_range/sendfile call */
+
+/* Command substitution */
+#define MAXSUBST       32   /* max $(...) and variables on a command line */
+#define SUBSTMARK    '\001' /* marks where a substitution's output goes */
+#define SUBSTBUFSIZE  4096  /* initial size of the substitution arena */
+
+/* Compiled script cache (.tshc sidecar files) */
+#define TSHC_MAGIC   0x43485354 /* "TSHC" */
+#define TSHC_VERSION 2          /* bump whenever the format or parsing changes */
+#define TSHC_BG      0x01       /* command runs in the background */
+#define TSHC_RAW     0x02       /* line goes through eval when it is run */
+#define TSHC_QUOTED  0x80000000 /* word offset flag: the word was quoted */
+
+/* Metrics endpoint */
+#define HISTBUCKETS    32   /* log2 microsecond latency histogram buckets */
+#define SEQRETRIES    100   /* snapshot attempts before giving up */
+
+/* Event tracing */
+#define TRACE_RING   8192       /* events kept in the ring (a power of 2) */
+#define TRACE_MAGIC  0x43525454 /* "TTRC", starts a trace dump */
+
+/* Trace event types */
+#define EV_LINE    1 /* command line read */
+#define EV_PARSE   2 /* command line parsed */
+#define EV_FORK    3 /* child running after fork (recorded by the child) */
+#define EV_EXEC    4 /* child about to execve (recorded by the child) */
+#define EV_SIGCHLD 5 /* SIGCHLD handler entered */
+#define EV_REAP    6 /* child reaped (arg = wait status) */
+#define EV_STATE   7 /* job state changed (arg = new state) */
+#define EV_SIGNAL  8 /* signal sent to a job (arg = signal) */
+#define EV_SPAWN   9 /* fork returned a child (recorded by the shell) */
+
+struct trace_event_t {      /* One trace record */
+    uint64_t ns;            /* CLOCK_MONOTONIC timestamp */
+    uint32_t seq;           /* index + 1 once the record is complete */
+    uint16_t type;          /* EV_* */
+    uint16_t pad;
+    int32_t pid;            /* child the event is about, or 0 */
+    int32_t arg;            /* event-specific argument */
+};
+
+struct trace_hdr_t {        /* Header of a trace dump */
+    uint32_t magic;         /* TRACE_MAGIC */
+    uint32_t count;         /* number of events that follow */
+    uint64_t dropped;       /* events overwritten before the dump */
+};
+
+/* Command history log */
+#define HLOG_MAGIC   0x474c4854 /* "THLG" */
+#define HLOG_VERSION 2          /* bump whenever the record format changes */
+#define HLOG_INITSIZE (1<<16)   /* initial size of the log file */
+#define HLOG_DONE    0x454e4f44 /* record's text is complete ("DONE") */
+#define HLOG_RUNNING INT32_MIN  /* status of a command still running */
+
+/* Control flow */
+#define MAXVARS        64   /* max shell variables */
+#define MAXVARNAME     32   /* max length of a variable name + 1 */
+
+/* Control flow keywords */
+#define CF_NONE  0 /* not a keyword: a simple command */
+#define CF_FOR   1 /* for name in words... */
+#define CF_WHILE 2
+#define CF_IF    3
+#define CF_DO    4
+#define CF_DONE  5
+#define CF_THEN  6
+#define CF_ELIF  7
+#define CF_ELSE  8
+#define CF_FI    9
+
+/* Wildcard expansion */
+#define GLOBBUFSIZE (1<<18) /* bytes read per getdents64 call */
+#define MAXDIRCACHE    64   /* directory listings cached per command line */
+#define MAXGLOBDEPTH   32   /* max path components in a wildcard word */
+#define MAXGLOBSETS    32   /* max [...] sets in one path component */
+#define CHUNKSIZE   (1<<16) /* size of a string arena chunk */
+
+/* Compiled wildcard pattern operations */
+#define PAT_END  0 /* end of pattern */
+#define PAT_CHAR 1 /* match one literal character */
+#define PAT_ANY  2 /* ? matches any one character */
+#define PAT_STAR 3 /* * matches any run of characters */
+#define PAT_SET  4 /* [...] matches one character from a set */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -0,0 +1,193 @@
+/* 
+ * tshtrace.c - Decode a trace dump written by tsh's "trace dump"
+ * 
+ * usage: tshtrace <file>
+ * Prints one line per child with the time spent in each step from
+ * reading its command line to reaping it, then the mean of each step.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "tsh.h"
+
+#define NSTEPS 5
+
+struct child_t {            /* What we know about one child */
+    int pid;
+    uint64_t line;          /* EV_LINE that started it */
+    uint64_t parse;         /* EV_PARSE */
+    uint64_t spawn;         /* EV_SPAWN, the shell's side of the fork */
+    uint64_t fork;          /* EV_FORK */
+    uint64_t exec;          /* EV_EXEC */
+    uint64_t sigchld;       /* EV_SIGCHLD that led to the reap */
+    uint64_t reap;          /* EV_REAP */
+    int status;             /* wait status when reaped */
+    int signals;            /* signals the shell sent it */
+    int stops;              /* times it was stopped */
+};
+
+char *steps[NSTEPS] = { "parse", "fork", "exec", "run", "reap" };
+
+/* evcmp - qsort comparison: order events by timestamp */
+int evcmp(const void *a, const void *b)
+{
+    const struct trace_event_t *x = a, *y = b;
+
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+/* newkid - Start a record for a child we have not seen yet */
+struct child_t *newkid(struct child_t *kids, int *nkids, int pid)
+{
+    struct child_t *k = &kids[(*nkids)++];
+
+    k->pid = pid;
+    return k;
+}
+
+/* interval - Microseconds from a to b, or -1 if either is unknown */
+double interval(uint64_t a, uint64_t b)
+{
+    return (a && b) ? (double)(b - a) / 1000 : -1;
+}
+
+int main(int argc, char **argv) 
+{
+    struct trace_hdr_t hdr;
+    struct trace_event_t *evs, *ev;
+    struct child_t *kids, *k;
+    uint64_t line = 0, parse = 0, sigchld = 0;
+    double t[NSTEPS], sum[NSTEPS];
+    int cnt[NSTEPS];
+    int i, j, nkids = 0, lines = 0;
+    FILE *fp;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+	exit(1);
+    }
+    if ((fp = fopen(argv[1], "r")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC) {
+	fprintf(stderr, "%s: not a tsh trace dump\n", argv[1]);
+	exit(1);
+    }
+    evs = malloc(hdr.count * sizeof(*evs) + 1);
+    kids = calloc(hdr.count + 1, sizeof(*kids));
+    if (evs == NULL || kids == NULL ||
+	fread(evs, sizeof(*evs), hdr.count, fp) != hdr.count) {
+	fprintf(stderr, "%s: truncated trace dump\n", argv[1]);
+	exit(1);
+    }
+    fclose(fp);
+
+    /* Children write into the same ring, so sort by time first */
+    qsort(evs, hdr.count, sizeof(*evs), evcmp);
+
+    for (i = 0; i < hdr.count; i++) {
+	ev = &evs[i];
+
+	/* The child an event is about: the latest one with that pid */
+	k = NULL;
+	for (j = nkids - 1; ev->pid != 0 && j >= 0; j--)
+	    if (kids[j].pid == ev->pid) {
+		k = &kids[j];
+		break;
+	    }
+
+	switch (ev->type) {
+	case EV_LINE:
+	    line = ev->ns;
+	    lines++;
+	    break;
+	case EV_PARSE:
+	    parse = ev->ns;
+	    break;
+	case EV_SIGCHLD:
+	    sigchld = ev->ns;
+	    break;
+	case EV_SPAWN:
+	    /* Only the shell reads lines, so its own view is the right one */
+	    if (k == NULL || k->spawn)
+		k = newkid(kids, &nkids, ev->pid);
+	    k->spawn = ev->ns;
+	    k->line = line;
+	    k->parse = parse;
+	    break;
+	case EV_FORK:
+	    /* The child may get here before the shell records EV_SPAWN */
+	    if (k == NULL || k->fork)
+		k = newkid(kids, &nkids, ev->pid);
+	    k->fork = ev->ns;
+	    break;
+	case EV_EXEC:
+	    if (k != NULL)
+		k->exec = ev->ns;
+	    break;
+	case EV_REAP:
+	    if (k != NULL) {
+		k->reap = ev->ns;
+		k->sigchld = sigchld;
+		k->status = ev->arg;
+	    }
+	    break;
+	case EV_STATE:
+	    if (k != NULL && ev->arg == ST)
+		k->stops++;
+	    break;
+	case EV_SIGNAL:
+	    if (k != NULL)
+		k->signals++;
+	    break;
+	}
+    }
+
+    printf("%d events (%llu dropped), %d command lines, %d children\n\n",
+	   hdr.count, (unsigned long long)hdr.dropped, lines, nkids);
+    printf("%8s", "pid");
+    for (j = 0; j < NSTEPS; j++)
+	printf(" %11s", steps[j]);
+    printf("  sigs stops  status\n");
+
+    memset(sum, 0, sizeof(sum));
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < nkids; i++) {
+	k = &kids[i];
+	t[0] = interval(k->line, k->parse);   /* line read to parsed */
+	t[1] = interval(k->parse, k->fork);   /* parsed to child running */
+	t[2] = interval(k->fork, k->exec);    /* child running to execve */
+	t[3] = interval(k->exec, k->sigchld); /* execve to SIGCHLD */
+	t[4] = interval(k->sigchld, k->reap); /* SIGCHLD to reaped */
+
+	printf("%8d", k->pid);
+	for (j = 0; j < NSTEPS; j++) {
+	    if (t[j] < 0) {
+		printf(" %11s", "-");
+		continue;
+	    }
+	    printf(" %9.1fus", t[j]);
+	    sum[j] += t[j];
+	    cnt[j]++;
+	}
+	printf("  %4d %5d  ", k->signals, k->stops);
+	if (k->reap == 0)
+	    printf("running\n");
+	else if (WIFSIGNALED(k->status))
+	    printf("signal %d\n", WTERMSIG(k->status));
+	else
+	    printf("exit %d\n", WEXITSTATUS(k->status));
+    }
+
+    printf("%8s", "mean");
+    for (j = 0; j < NSTEPS; j++) {
+	if (cnt[j] == 0)
+	    printf(" %11s", "-");
+	else
+	    printf(" %9.1fus", sum[j] / cnt[j]);
+    }
+    printf("\n");
+    exit(0);
+}